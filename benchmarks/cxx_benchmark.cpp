@@ -0,0 +1,685 @@
+/**
+ * cxx_benchmark.cpp - this file is part of cxx-opcodes.
+ *
+ * Copyright (C) 2021 by Michael Gogins
+ *
+ * cxx-opcodes is free software; you can redistribute it
+ * and/or modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * cxxopcodes is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with cxx-opcodes; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ * This program measures the hot paths of the CXX opcodes without running
+ * Csound or opening an audio device. It loads the plugin as Csound does, and
+ * runs the opcodes through the functions that the plugin registers, in a
+ * fake Csound instance that implements only the parts of the API that the
+ * opcodes use. It measures:
+ *
+ * - the latency of `cxx_compile`, with an empty cache, and with the module
+ *   already in the cache;
+ * - the throughput of `cxx_invoke` notes, i.e. init and noteoff, with 1 to
+ *   1000 loaded modules, both for notes of the same instrument, which find
+ *   their factory in the binding cache, and for notes of different
+ *   instruments, which look it up in the registry;
+ * - the cost of one kperiod of `cxx_invoke`, `cxx_invoke_a`, `cxx_invoke_k`,
+ *   and of native opcodes registered by `cxx_append_opcode`, for a-rate and
+ *   k-rate invokables;
+ * - the cost of creating and destroying an instance, with and without a
+ *   pool.
+ *
+ * The results are written as one JSON object to the standard output, or to
+ * the file given by `--output`, so that they can be compared from build to
+ * build. Diagnostics are written to the standard error.
+ *
+ * Usage: cxx_benchmark [--plugin filepath] [--compiler command]
+ *     [--modules 1,10,100,1000] [--iterations count] [--output filepath]
+ *     [--verbose]
+ */
+
+#include <csdl.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#if defined(WIN32)
+#include <windows.h>
+#else
+#include <dlfcn.h>
+#endif
+
+#if !defined(CXX_BENCHMARK_PLUGIN)
+#define CXX_BENCHMARK_PLUGIN "libcsound_cxx.so"
+#endif
+#if !defined(CXX_BENCHMARK_COMPILER_COMMAND)
+#define CXX_BENCHMARK_COMPILER_COMMAND "g++ -O2 -fPIC -shared -std=c++17 -DUSE_DOUBLE -I. -I/usr/local/include/csound"
+#endif
+
+namespace {
+
+const uint32_t ksmps = 64;
+const MYFLT sr = 48000;
+
+bool verbose = false;
+int64_t kcounter = 0;
+
+/**
+ * An opcode registered by the plugin, or by a module, with one fake Csound
+ * instance.
+ */
+struct FakeOpcode {
+    std::string outypes;
+    std::string intypes;
+    int dsblksiz;
+    int (*iopadr)(CSOUND *, void *);
+    int (*kopadr)(CSOUND *, void *);
+};
+
+std::map<std::pair<CSOUND *, std::string>, void *> &global_variables() {
+    static std::map<std::pair<CSOUND *, std::string>, void *> global_variables_;
+    return global_variables_;
+}
+
+std::map<std::pair<CSOUND *, std::string>, FakeOpcode> &opcodes() {
+    static std::map<std::pair<CSOUND *, std::string>, FakeOpcode> opcodes_;
+    return opcodes_;
+}
+
+std::multimap<void *, int (*)(CSOUND *, void *)> &deinit_callbacks() {
+    static std::multimap<void *, int (*)(CSOUND *, void *)> deinit_callbacks_;
+    return deinit_callbacks_;
+}
+
+/**
+ * The type of each argument, which Csound keeps in front of the argument
+ * itself.
+ */
+std::map<const void *, const CS_TYPE *> &argument_types() {
+    static std::map<const void *, const CS_TYPE *> argument_types_;
+    return argument_types_;
+}
+
+const CS_TYPE *make_type(const char *name) {
+    auto type = new CS_TYPE();
+    type->varTypeName = (char *) name;
+    return type;
+}
+
+const CS_TYPE *a_type = make_type("a");
+const CS_TYPE *k_type = make_type("k");
+const CS_TYPE *i_type = make_type("i");
+const CS_TYPE *S_type = make_type("S");
+
+void message(CSOUND *, const char *format, ...) {
+    if (verbose) {
+        va_list args;
+        va_start(args, format);
+        std::vfprintf(stderr, format, args);
+        va_end(args);
+    }
+}
+
+void message_v(CSOUND *, int, const char *format, va_list args) {
+    if (verbose) {
+        std::vfprintf(stderr, format, args);
+    }
+}
+
+int init_error(CSOUND *, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    std::fprintf(stderr, "INIT ERROR: ");
+    std::vfprintf(stderr, format, args);
+    va_end(args);
+    return NOTOK;
+}
+
+int perf_error(CSOUND *, OPDS *, const char *format, ...) {
+    va_list args;
+    va_start(args, format);
+    std::fprintf(stderr, "PERF ERROR: ");
+    std::vfprintf(stderr, format, args);
+    va_end(args);
+    return NOTOK;
+}
+
+void *load_library(const std::string &filepath) {
+#if defined(WIN32)
+    return (void *) LoadLibrary(filepath.c_str());
+#else
+    return dlopen(filepath.c_str(), RTLD_NOW | RTLD_LOCAL);
+#endif
+}
+
+void *library_symbol(void *library, const char *name) {
+#if defined(WIN32)
+    return (void *) GetProcAddress((HMODULE) library, name);
+#else
+    return dlsym(library, name);
+#endif
+}
+
+void set_environment_variable(const char *name, const std::string &value) {
+#if defined(WIN32)
+    _putenv_s(name, value.c_str());
+#else
+    setenv(name, value.c_str(), 1);
+#endif
+}
+
+/**
+ * The entry points of the plugin.
+ */
+struct Plugin {
+    int (*init)(CSOUND *) = nullptr;
+    int (*destroy)(CSOUND *) = nullptr;
+};
+
+/**
+ * A Csound instance that implements only what the opcodes use. Creating it
+ * initializes the plugin for it, and destroying it destroys the plugin for
+ * it, as Csound does.
+ */
+class FakeCsound {
+public:
+    FakeCsound(const Plugin &plugin_) : plugin(plugin_) {
+        csound = (CSOUND *) std::calloc(1, sizeof(CSOUND));
+        csound->GetSr = [](CSOUND *) -> MYFLT {
+            return sr;
+        };
+        csound->GetKsmps = [](CSOUND *) -> uint32_t {
+            return ksmps;
+        };
+        csound->GetKcounter = [](CSOUND *) -> decltype(std::declval<CSOUND>().GetKcounter(nullptr)) {
+            return kcounter;
+        };
+        csound->GetMessageLevel = [](CSOUND *) {
+            return verbose ? 7 : 0;
+        };
+        csound->Message = message;
+        csound->MessageV = message_v;
+        csound->InitError = init_error;
+        csound->PerfError = perf_error;
+        csound->strarg2name = [](CSOUND *, char *, void *p, const char *, int) -> char * {
+            return strdup((const char *) p);
+        };
+        csound->GetLibrarySymbol = library_symbol;
+        csound->AppendOpcode = [](CSOUND *csound_, const char *name, int dsblksiz, int, int, const char *outypes, const char *intypes, int (*iopadr)(CSOUND *, void *), int (*kopadr)(CSOUND *, void *), int (*)(CSOUND *, void *)) {
+            opcodes()[{csound_, name}] = FakeOpcode{outypes, intypes, dsblksiz, iopadr, kopadr};
+            return 0;
+        };
+        csound->CreateGlobalVariable = [](CSOUND *csound_, const char *name, size_t size) {
+            auto &variable = global_variables()[{csound_, name}];
+            if (variable != nullptr) {
+                return CSOUND_ERROR;
+            }
+            variable = std::calloc(1, size);
+            return CSOUND_SUCCESS;
+        };
+        csound->QueryGlobalVariable = [](CSOUND *csound_, const char *name) -> void * {
+            auto it = global_variables().find({csound_, name});
+            return it == global_variables().end() ? nullptr : it->second;
+        };
+        csound->QueryGlobalVariableNoCheck = csound->QueryGlobalVariable;
+        csound->DestroyGlobalVariable = [](CSOUND *csound_, const char *name) {
+            auto it = global_variables().find({csound_, name});
+            if (it == global_variables().end()) {
+                return CSOUND_ERROR;
+            }
+            std::free(it->second);
+            global_variables().erase(it);
+            return CSOUND_SUCCESS;
+        };
+        csound->RegisterDeinitCallback = [](CSOUND *, void *p, int (*callback)(CSOUND *, void *)) {
+            deinit_callbacks().insert({p, callback});
+            return OK;
+        };
+        csound->GetReinitFlag = [](CSOUND *) {
+            return 0;
+        };
+        csound->GetTieFlag = [](CSOUND *) {
+            return 0;
+        };
+        csound->GetTypeForArg = [](void *argument) {
+            auto it = argument_types().find(argument);
+            return it == argument_types().end() ? (const CS_TYPE *) nullptr : it->second;
+        };
+        plugin.init(csound);
+    }
+    ~FakeCsound() {
+        plugin.destroy(csound);
+        for (auto it = opcodes().begin(); it != opcodes().end(); ) {
+            if (it->first.first == csound) {
+                it = opcodes().erase(it);
+            } else {
+                ++it;
+            }
+        }
+        std::free(csound);
+    }
+    const FakeOpcode *opcode(const char *name) const {
+        auto it = opcodes().find({csound, name});
+        if (it == opcodes().end()) {
+            return nullptr;
+        }
+        return &it->second;
+    }
+    CSOUND *csound;
+private:
+    const Plugin &plugin;
+};
+
+/**
+ * One opcode in one note. Its memory is laid out as Csound lays it out, with
+ * the OPDS followed by pointers to the outputs, as many as the output types
+ * of the opcode, and then to the inputs. Notes of the same instrument share
+ * the same OPTXT.
+ */
+class FakeNote {
+public:
+    FakeNote(FakeCsound &host_, const char *name, const std::vector<void *> &outputs, const std::vector<void *> &inputs, OPTXT *shared_optxt = nullptr) : host(host_) {
+        opcode = host.opcode(name);
+        if (opcode == nullptr) {
+            std::fprintf(stderr, "cxx_benchmark: opcode \"%s\" is not registered.\n", name);
+            std::exit(EXIT_FAILURE);
+        }
+        memory.resize(opcode->dsblksiz / sizeof(std::max_align_t) + 1);
+        block = memory.data();
+        optxt = shared_optxt != nullptr ? shared_optxt : &own_optxt;
+        optxt->t.opcod = (char *) name;
+        optxt->t.inArgCount = inputs.size();
+        optxt->t.outArgCount = outputs.size();
+        insds.ksmps = ksmps;
+        auto opds = (OPDS *) block;
+        opds->optext = optxt;
+        opds->insdshead = &insds;
+        auto arguments = (void **) ((char *) block + sizeof(OPDS));
+        size_t index = 0;
+        for (auto output : outputs) {
+            arguments[index++] = output;
+        }
+        index = std::max(index, opcode->outypes.size());
+        for (auto input : inputs) {
+            arguments[index++] = input;
+        }
+    }
+    int init() {
+        return opcode->iopadr(host.csound, block);
+    }
+    int kontrol() {
+        return opcode->kopadr(host.csound, block);
+    }
+    int noteoff() {
+        int result = OK;
+        auto range = deinit_callbacks().equal_range(block);
+        for (auto it = range.first; it != range.second; ++it) {
+            result |= it->second(host.csound, block);
+        }
+        deinit_callbacks().erase(range.first, range.second);
+        return result;
+    }
+private:
+    FakeCsound &host;
+    const FakeOpcode *opcode;
+    std::vector<std::max_align_t> memory;
+    void *block;
+    OPTXT own_optxt = {};
+    OPTXT *optxt;
+    INSDS insds = {};
+};
+
+/**
+ * A string argument.
+ */
+struct FakeString {
+    FakeString(const std::string &value_) : value(value_) {
+        data.data = (char *) value.c_str();
+        data.size = (int) value.size() + 1;
+        argument_types()[&data] = S_type;
+    }
+    std::string value;
+    STRINGDAT data;
+};
+
+/**
+ * A signal or scalar argument.
+ */
+struct FakeSignal {
+    FakeSignal(const CS_TYPE *type) : samples(ksmps, 0) {
+        argument_types()[samples.data()] = type;
+    }
+    MYFLT *data() {
+        return samples.data();
+    }
+    std::vector<MYFLT> samples;
+};
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int compile(FakeCsound &host, const std::string &compiler_command, const std::string &entry_point, const std::string &source_code) {
+    FakeSignal i_result(i_type);
+    FakeString S_entry_point(entry_point), S_source_code(source_code), S_compiler_command(compiler_command);
+    FakeNote note(host, "cxx_compile", {i_result.data()}, {&S_entry_point.data, &S_source_code.data, &S_compiler_command.data});
+    if (note.init() != OK) {
+        return NOTOK;
+    }
+    note.noteoff();
+    return (int) i_result.data()[0];
+}
+
+/**
+ * Compiles modules on the background threads of `cxx_compile_async`, and
+ * starts them. Returns the number of failures.
+ */
+int compile_all(FakeCsound &host, const std::string &compiler_command, const std::vector<std::pair<std::string, std::string>> &modules) {
+    for (auto &module : modules) {
+        FakeSignal i_handle(i_type);
+        FakeString S_entry_point(module.first), S_source_code(module.second), S_compiler_command(compiler_command);
+        FakeNote note(host, "cxx_compile_async", {i_handle.data()}, {&S_entry_point.data, &S_source_code.data, &S_compiler_command.data});
+        note.init();
+        note.noteoff();
+    }
+    FakeSignal i_failures(i_type);
+    FakeNote note(host, "cxx_compile_wait", {i_failures.data()}, {});
+    note.init();
+    note.noteoff();
+    return (int) i_failures.data()[0];
+}
+
+std::string module_source(int index) {
+    std::ostringstream stream;
+    stream << "#include <cxx_invokable.hpp>\n"
+        << "struct Module" << index << " : public CxxInvokableBase {\n"
+        << "    int kontrol(CSOUND *csound, MYFLT **outputs, MYFLT **inputs) override {\n"
+        << "        return OK;\n"
+        << "    }\n"
+        << "};\n"
+        << "extern \"C\" CxxInvokable *bench_factory_" << index << "() {\n"
+        << "    return new Module" << index << "();\n"
+        << "}\n"
+        << "extern \"C\" int bench_module_" << index << "(CSOUND *csound) {\n"
+        << "    return 0;\n"
+        << "}\n";
+    return stream.str();
+}
+
+const char *dispatch_source = R"(
+#include <cxx_invokable.hpp>
+struct AudioCopy : public CxxInvokableBase {
+    int kontrol(CSOUND *csound, MYFLT **outputs, MYFLT **inputs) override {
+        for (uint32_t i = 0, n = ksmps(); i < n; ++i) {
+            outputs[0][i] = inputs[0][i];
+        }
+        return OK;
+    }
+};
+struct ControlCopy : public CxxInvokableBase {
+    int kontrol(CSOUND *csound, MYFLT **outputs, MYFLT **inputs) override {
+        *outputs[0] = *inputs[0];
+        return OK;
+    }
+};
+struct Pooled : public CxxInvokableBase {
+    int kontrol(CSOUND *csound, MYFLT **outputs, MYFLT **inputs) override {
+        *outputs[0] = *inputs[0];
+        return OK;
+    }
+};
+extern "C" CxxInvokable *bench_audio() {
+    return new AudioCopy();
+}
+extern "C" CxxInvokable *bench_control() {
+    return new ControlCopy();
+}
+extern "C" CxxInvokable *bench_pooled() {
+    return new Pooled();
+}
+CXX_INVOKABLE_POOL(bench_pooled, Pooled, 16)
+extern "C" int bench_dispatch(CSOUND *csound) {
+    int result = cxx_append_opcode<AudioCopy, 1, 1>(csound, "bench_native_a", "a", "a");
+    result |= cxx_append_opcode<ControlCopy, 1, 1>(csound, "bench_native_k", "k", "k");
+    return result;
+}
+)";
+
+/**
+ * Returns the time of one note, i.e. init and noteoff, in nanoseconds,
+ * either with every note in the same instrument, or with every note in a
+ * different one.
+ */
+double note_nanoseconds(FakeCsound &host, const char *factory, int iterations, bool same_instrument) {
+    FakeString S_factory(factory);
+    FakeSignal output(k_type), i_thread(i_type);
+    i_thread.data()[0] = 3;
+    std::vector<OPTXT> optxts(same_instrument ? 1 : iterations, OPTXT());
+    // The first note resolves the factory.
+    {
+        FakeNote note(host, "cxx_invoke", {output.data()}, {&S_factory.data, i_thread.data()});
+        if (note.init() != OK) {
+            std::exit(EXIT_FAILURE);
+        }
+        note.noteoff();
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        FakeNote note(host, "cxx_invoke", {output.data()}, {&S_factory.data, i_thread.data()}, &optxts[same_instrument ? 0 : i]);
+        note.init();
+        note.noteoff();
+    }
+    return seconds_since(start) * 1.0e9 / iterations;
+}
+
+/**
+ * Returns the time of one kperiod of the note in nanoseconds.
+ */
+double kontrol_nanoseconds(FakeNote &note, int iterations) {
+    if (note.init() != OK) {
+        std::exit(EXIT_FAILURE);
+    }
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < iterations; ++i) {
+        note.kontrol();
+        kcounter++;
+    }
+    auto nanoseconds = seconds_since(start) * 1.0e9 / iterations;
+    note.noteoff();
+    return nanoseconds;
+}
+
+std::string json_number(double value) {
+    char buffer[64];
+    std::snprintf(buffer, sizeof(buffer), "%.6g", value);
+    return buffer;
+}
+
+std::string json_array(const std::vector<double> &values) {
+    std::string json = "[";
+    for (size_t i = 0; i < values.size(); ++i) {
+        json += (i == 0 ? "" : ", ") + json_number(values[i]);
+    }
+    return json + "]";
+}
+
+std::string json_string(const std::string &value) {
+    std::string json = "\"";
+    for (auto c : value) {
+        if (c == '"' || c == '\\') {
+            json += '\\';
+        }
+        json += c;
+    }
+    return json + "\"";
+}
+
+}
+
+int main(int argc, char **argv) {
+    std::string plugin_filepath = CXX_BENCHMARK_PLUGIN;
+    std::string compiler_command = CXX_BENCHMARK_COMPILER_COMMAND;
+    std::vector<int> module_counts = {1, 10, 100};
+    int iterations = 100000;
+    std::string output_filepath;
+    for (int i = 1; i < argc; ++i) {
+        std::string option = argv[i];
+        if (option == "--verbose") {
+            verbose = true;
+        } else if (i + 1 < argc && option == "--plugin") {
+            plugin_filepath = argv[++i];
+        } else if (i + 1 < argc && option == "--compiler") {
+            compiler_command = argv[++i];
+        } else if (i + 1 < argc && option == "--iterations") {
+            iterations = std::max(std::atoi(argv[++i]), 1);
+        } else if (i + 1 < argc && option == "--output") {
+            output_filepath = argv[++i];
+        } else if (i + 1 < argc && option == "--modules") {
+            module_counts.clear();
+            std::istringstream stream(argv[++i]);
+            std::string count;
+            while (std::getline(stream, count, ',')) {
+                if (std::atoi(count.c_str()) > 0) {
+                    module_counts.push_back(std::atoi(count.c_str()));
+                }
+            }
+            std::sort(module_counts.begin(), module_counts.end());
+        } else {
+            std::fprintf(stderr, "Usage: cxx_benchmark [--plugin filepath] [--compiler command] [--modules 1,10,100,1000] [--iterations count] [--output filepath] [--verbose]\n");
+            return EXIT_FAILURE;
+        }
+    }
+    // Every run starts with an empty cache of its own.
+    auto cache_directory = std::filesystem::temp_directory_path() / ("cxx_benchmark_" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count()));
+    std::filesystem::create_directories(cache_directory);
+    set_environment_variable("CXX_OPCODES_CACHE_DIR", cache_directory.string());
+    auto library = load_library(plugin_filepath);
+    if (library == nullptr) {
+        std::fprintf(stderr, "cxx_benchmark: could not load the plugin \"%s\".\n", plugin_filepath.c_str());
+        return EXIT_FAILURE;
+    }
+    Plugin plugin;
+    plugin.init = (int (*)(CSOUND *)) library_symbol(library, "csoundModuleInit_cxx_opcodes");
+    plugin.destroy = (int (*)(CSOUND *)) library_symbol(library, "csoundModuleDestroy_cxx_opcodes");
+    if (plugin.init == nullptr || plugin.destroy == nullptr) {
+        std::fprintf(stderr, "cxx_benchmark: \"%s\" is not the CXX opcodes plugin.\n", plugin_filepath.c_str());
+        return EXIT_FAILURE;
+    }
+    std::string json = "{\n";
+    json += "    \"plugin\": " + json_string(plugin_filepath) + ",\n";
+    json += "    \"compiler_command\": " + json_string(compiler_command) + ",\n";
+    json += "    \"ksmps\": " + std::to_string(ksmps) + ",\n";
+    json += "    \"iterations\": " + std::to_string(iterations) + ",\n";
+
+    // The latency of cxx_compile, first with an empty cache, and then in
+    // another Csound instance, which finds the module in the cache.
+    std::fprintf(stderr, "cxx_benchmark: compiling...\n");
+    std::vector<double> cold_milliseconds;
+    std::vector<double> cached_milliseconds;
+    {
+        FakeCsound host(plugin);
+        for (int i = 0; i < 3; ++i) {
+            auto index = 1000000 + i;
+            auto start = std::chrono::steady_clock::now();
+            if (compile(host, compiler_command, "bench_module_" + std::to_string(index), module_source(index)) != OK) {
+                std::fprintf(stderr, "cxx_benchmark: cxx_compile failed; use --verbose to see why.\n");
+                return EXIT_FAILURE;
+            }
+            cold_milliseconds.push_back(seconds_since(start) * 1.0e3);
+            FakeCsound other_host(plugin);
+            start = std::chrono::steady_clock::now();
+            compile(other_host, compiler_command, "bench_module_" + std::to_string(index), module_source(index));
+            cached_milliseconds.push_back(seconds_since(start) * 1.0e3);
+        }
+    }
+    json += "    \"compile\": {\n";
+    json += "        \"cold_milliseconds\": " + json_array(cold_milliseconds) + ",\n";
+    json += "        \"cached_milliseconds\": " + json_array(cached_milliseconds) + "\n";
+    json += "    },\n";
+
+    // The throughput of cxx_invoke notes as the number of loaded modules
+    // grows. The factory is in the module that was loaded last.
+    json += "    \"invoke\": [\n";
+    {
+        FakeCsound host(plugin);
+        int loaded = 0;
+        for (size_t i = 0; i < module_counts.size(); ++i) {
+            auto count = module_counts[i];
+            std::fprintf(stderr, "cxx_benchmark: invoking with %d modules...\n", count);
+            std::vector<std::pair<std::string, std::string>> modules;
+            for (; loaded < count; ++loaded) {
+                modules.push_back({"bench_module_" + std::to_string(loaded), module_source(loaded)});
+            }
+            if (compile_all(host, compiler_command, modules) != 0) {
+                std::fprintf(stderr, "cxx_benchmark: cxx_compile_async failed; use --verbose to see why.\n");
+                return EXIT_FAILURE;
+            }
+            auto factory = "bench_factory_" + std::to_string(count - 1);
+            auto same_instrument = note_nanoseconds(host, factory.c_str(), iterations, true);
+            auto different_instruments = note_nanoseconds(host, factory.c_str(), iterations, false);
+            json += "        {\"modules\": " + std::to_string(count);
+            json += ", \"notes_per_second\": " + json_number(1.0e9 / same_instrument);
+            json += ", \"notes_per_second_uncached\": " + json_number(1.0e9 / different_instruments) + "}";
+            json += i + 1 < module_counts.size() ? ",\n" : "\n";
+        }
+    }
+    json += "    ],\n";
+
+    // The cost of one kperiod, and of creating and destroying an instance.
+    std::fprintf(stderr, "cxx_benchmark: dispatching...\n");
+    {
+        FakeCsound host(plugin);
+        if (compile(host, compiler_command, "bench_dispatch", dispatch_source) != OK) {
+            std::fprintf(stderr, "cxx_benchmark: cxx_compile failed; use --verbose to see why.\n");
+            return EXIT_FAILURE;
+        }
+        FakeSignal a_input(a_type), a_output(a_type), k_input(k_type), k_output(k_type), i_thread(i_type);
+        i_thread.data()[0] = 3;
+        FakeString S_audio("bench_audio"), S_control("bench_control");
+        auto kperiods = iterations * 10;
+        FakeNote invoke_a(host, "cxx_invoke", {a_output.data()}, {&S_audio.data, i_thread.data(), a_input.data()});
+        FakeNote invoke_k(host, "cxx_invoke", {k_output.data()}, {&S_control.data, i_thread.data(), k_input.data()});
+        FakeNote typed_a(host, "cxx_invoke_a", {a_output.data()}, {&S_audio.data, a_input.data()});
+        FakeNote typed_k(host, "cxx_invoke_k", {k_output.data()}, {&S_control.data, k_input.data()});
+        FakeNote native_a(host, "bench_native_a", {a_output.data()}, {a_input.data()});
+        FakeNote native_k(host, "bench_native_k", {k_output.data()}, {k_input.data()});
+        json += "    \"kontrol_nanoseconds\": {\n";
+        json += "        \"cxx_invoke_a_rate\": " + json_number(kontrol_nanoseconds(invoke_a, kperiods)) + ",\n";
+        json += "        \"cxx_invoke_k_rate\": " + json_number(kontrol_nanoseconds(invoke_k, kperiods)) + ",\n";
+        json += "        \"cxx_invoke_a\": " + json_number(kontrol_nanoseconds(typed_a, kperiods)) + ",\n";
+        json += "        \"cxx_invoke_k\": " + json_number(kontrol_nanoseconds(typed_k, kperiods)) + ",\n";
+        json += "        \"native_a_rate\": " + json_number(kontrol_nanoseconds(native_a, kperiods)) + ",\n";
+        json += "        \"native_k_rate\": " + json_number(kontrol_nanoseconds(native_k, kperiods)) + "\n";
+        json += "    },\n";
+        json += "    \"instance_nanoseconds\": {\n";
+        json += "        \"create_destroy\": " + json_number(note_nanoseconds(host, "bench_control", iterations, true)) + ",\n";
+        json += "        \"create_destroy_pooled\": " + json_number(note_nanoseconds(host, "bench_pooled", iterations, true)) + "\n";
+        json += "    }\n";
+    }
+    json += "}\n";
+    std::error_code error;
+    std::filesystem::remove_all(cache_directory, error);
+    if (output_filepath.empty()) {
+        std::fputs(json.c_str(), stdout);
+    } else {
+        std::ofstream(output_filepath) << json;
+    }
+    return EXIT_SUCCESS;
+}
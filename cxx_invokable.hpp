@@ -21,8 +21,16 @@ Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
 */
 
 #include <csdl.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cstdio>
+#include <cstddef>
 #include <cstring>
+#include <initializer_list>
+#include <new>
+#include <type_traits>
+#include <vector>
 
 /**
  * Defines the pure abstract interface implemented by Cxx modules to be 
@@ -48,9 +56,124 @@ struct CxxInvokable {
 	virtual int kontrol(CSOUND *csound, MYFLT **outputs, MYFLT **inputs) = 0;
 	/**
 	 * Called by Csound when the Csound instrument that contains this 
-	 * instance of the CxxInvokable is turned off.
+	 * instance of the CxxInvokable is turned off. Every instance that an 
+	 * opcode creates gets exactly one call to `noteoff` before it is 
+	 * destroyed or returned to its pool, whatever its thread: also when 
+	 * `init` was not called, with thread 2, or failed, and also when the 
+	 * instance was discarded because it declined to `migrate`. With 
+	 * thread 4, it is called on the offload worker, shortly after the 
+	 * instrument has been turned off.
 	 */
 	virtual int noteoff(CSOUND *csound) = 0;
+	/**
+	 * Called by `cxx_invoke`, after `init`, on a new instance from a module 
+	 * loaded by `cxx_reload`, with the instance from the replaced module 
+	 * that the note is running. Only called if the new module declares, 
+	 * with `CXX_INVOKABLE_MIGRATES`, that the factory migrates running 
+	 * notes, and only for notes that have a performance pass. Returns true 
+	 * if this instance has taken over the state of the previous instance, 
+	 * e.g. the tail of a reverb; then the note continues with this 
+	 * instance, and the previous instance is turned off. By default returns 
+	 * false, and the note keeps running the previous instance until its 
+	 * noteoff. The previous instance was compiled from the old source code, 
+	 * so its state may only be accessed through types whose layout has not 
+	 * changed.
+	 */
+	virtual bool migrate(CxxInvokable *previous) {
+		return false;
+	}
+};
+
+/**
+ * A view, without copying, of a numeric Csound array argument (`ARRAYDAT`), 
+ * whose members are stored in row-major order. For arrays of i-rate or 
+ * k-rate values, a member is one value; for arrays of audio signals, a 
+ * member is a block of `ksmps` samples. Opcodes may resize arrays, so a view 
+ * should be obtained again in every kperiod, rather than kept.
+ */
+struct CxxArrayView {
+    MYFLT *data = nullptr;
+    int dimensions = 0;
+    const int *sizes = nullptr;
+    // The number of values in each member.
+    size_t member_size = 1;
+    /**
+     * Returns the number of members in dimension `dimension`.
+     */
+    size_t extent(int dimension) const
+    {
+        return dimension < dimensions ? (size_t) sizes[dimension] : 0;
+    }
+    /**
+     * Returns the number of members in all dimensions.
+     */
+    size_t size() const
+    {
+        if (data == nullptr || dimensions == 0) {
+            return 0;
+        }
+        size_t size_ = 1;
+        for (int i = 0; i < dimensions; ++i) {
+            size_ *= sizes[i];
+        }
+        return size_;
+    }
+    MYFLT &operator[](size_t index) const
+    {
+        return data[index * member_size];
+    }
+    MYFLT &operator()(size_t row, size_t column) const
+    {
+        return data[(row * sizes[1] + column) * member_size];
+    }
+    /**
+     * Returns the values of member `index`, counted in row-major order.
+     */
+    MYFLT *member(size_t index) const
+    {
+        return data + index * member_size;
+    }
+};
+
+/**
+ * A view, without copying, of the current frame of an f-signal argument 
+ * (`PVSDAT`) in one of the streaming formats, e.g. `PVS_AMP_FREQ`, which 
+ * has `bins()` pairs of amplitude and frequency. The values are floats 
+ * whatever the size of `MYFLT`. Sliding f-signals are not supported.
+ */
+struct CxxFrameView {
+    float *data = nullptr;
+    int32_t N = 0;
+    int32_t overlap = 0;
+    int32_t winsize = 0;
+    int32_t format = 0;
+    // Incremented by the opcode that writes the f-signal for each new frame.
+    uint32_t *framecount = nullptr;
+    size_t bins() const
+    {
+        return N / 2 + 1;
+    }
+    float &amplitude(size_t bin) const
+    {
+        return data[2 * bin];
+    }
+    float &frequency(size_t bin) const
+    {
+        return data[2 * bin + 1];
+    }
+};
+
+/**
+ * A view, without copying, of a Csound function table (`FUNC`). The guard 
+ * point, if any, is at `data[length]`.
+ */
+struct CxxTableView {
+    MYFLT *data = nullptr;
+    size_t length = 0;
+    MYFLT &operator[](size_t index) const
+    {
+        return data[index];
+    }
 };
 
 /**
@@ -66,6 +189,9 @@ class CxxInvokableBase : public CxxInvokable {
             int result = OK;
             csound = csound_;
             opds = opds_;
+            init_outputs = outputs;
+            init_inputs = inputs;
+            opcode_inputs = opds == nullptr ? 0 : count_opcode_inputs(opds);
             return result;
         }
          int noteoff(CSOUND *csound) override 
@@ -76,6 +202,21 @@ class CxxInvokableBase : public CxxInvokable {
             int result = OK;
             return result;
         }
+        /**
+         * Called by `cxx_invoke` when a pooled instance is returned to its 
+         * pool after `noteoff`. Should restore the state that a newly 
+         * constructed instance would have, so that the instance can be 
+         * reused by another note without being constructed again. See 
+         * `CxxInvokablePool`.
+         */
+        virtual void reset()
+        {
+            opds = nullptr;
+            csound = nullptr;
+            init_outputs = nullptr;
+            init_inputs = nullptr;
+            opcode_inputs = 0;
+        }
         uint32_t kperiodOffset() const
         {
             if (opds == nullptr) {
@@ -83,17 +224,19 @@ class CxxInvokableBase : public CxxInvokable {
             }
             return opds->insdshead->ksmps_offset;
         }
+        /**
+         * Returns the index after the last sample of the kperiod that is to 
+         * be computed. Csound stores the number of samples to skip at the 
+         * end of the kperiod of a note that ends early, not an index.
+         */
         uint32_t kperiodEnd() const
         {
             if (opds == nullptr) {
                 return -0;
             }
-            uint32_t end = opds->insdshead->ksmps_no_end;
-            if (end) {
-                return end;
-            } else {
-                return ksmps();
-            }
+            uint32_t no_end = opds->insdshead->ksmps_no_end;
+            uint32_t ksmps_ = ksmps();
+            return no_end < ksmps_ ? ksmps_ - no_end : 0;
         }
         uint32_t ksmps() const
         {
@@ -114,8 +257,79 @@ class CxxInvokableBase : public CxxInvokable {
             if (opds == nullptr) {
                 return- 0;
             }
-            // The first two input arguments belong to the invoking opcode.
-            return (uint32_t)opds->optext->t.inArgCount - 2;
+            return (uint32_t)opds->optext->t.inArgCount - opcode_inputs;
+        }
+        /**
+         * Checks, at init time after `CxxInvokableBase::init`, the types of 
+         * the inputs of the opcode, one character per input from the first: 
+         * '[' for a numeric array, 'f' for an f-signal, 'a' for an audio 
+         * signal, 'k' for an i-rate or k-rate value, e.g. a function table 
+         * number, 'S' for a string, or '.' for any type. Inputs beyond the 
+         * end of `types` are not checked, but there must be at least as many 
+         * inputs as types. Returns `OK`, or reports an init error to 
+         * `csound_`, which is also told if `init` has not been called. The
+         * `array`, `frame`, and `table` views do not check the types of
+         * their arguments again.
+         */
+        int check_input_types(CSOUND *csound_, const char *types)
+        {
+            return check_types(csound_, init_inputs, input_arg_count(), types, "input");
+        }
+        /**
+         * Checks the types of the outputs of the opcode, as 
+         * `check_input_types` checks the inputs.
+         */
+        int check_output_types(CSOUND *csound_, const char *types)
+        {
+            return check_types(csound_, init_outputs, output_arg_count(), types, "output");
+        }
+        /**
+         * Returns a view of the numeric array `argument`, e.g. `inputs[0]`.
+         */
+        CxxArrayView array(MYFLT *argument) const
+        {
+            auto array_ = (ARRAYDAT *) argument;
+            CxxArrayView view;
+            view.data = array_->data;
+            view.dimensions = array_->dimensions;
+            view.sizes = array_->sizes;
+            view.member_size = array_->arrayMemberSize > 0 ? array_->arrayMemberSize / sizeof(MYFLT) : 1;
+            return view;
+        }
+        /**
+         * Returns a view of the current frame of the f-signal `argument`.
+         */
+        CxxFrameView frame(MYFLT *argument) const
+        {
+            auto fsig = (PVSDAT *) argument;
+            CxxFrameView view;
+            if (fsig->sliding) {
+                return view;
+            }
+            view.data = (float *) fsig->frame.auxp;
+            view.N = fsig->N;
+            view.overlap = fsig->overlap;
+            view.winsize = fsig->winsize;
+            view.format = fsig->format;
+            view.framecount = &fsig->framecount;
+            return view;
+        }
+        /**
+         * Returns a view of the function table whose number is the value of 
+         * `argument`, or an empty view if there is no such table.
+         */
+        CxxTableView table(MYFLT *argument) const
+        {
+            CxxTableView view;
+            if (csound == nullptr) {
+                return view;
+            }
+            auto function = csound->FTnp2Find(csound, argument);
+            if (function != nullptr) {
+                view.data = function->ftable;
+                view.length = function->flen;
+            }
+            return view;
         }
         void log(const char *format,...)
         {
@@ -153,4 +367,1094 @@ class CxxInvokableBase : public CxxInvokable {
     protected:
         OPDS *opds = nullptr;
         CSOUND *csound = nullptr;
+        // The arguments passed to `init`.
+        MYFLT **init_outputs = nullptr;
+        MYFLT **init_inputs = nullptr;
+    private:
+        // The number of input arguments of the invoking opcode that precede 
+        // the inputs of this instance, found once by `init`.
+        uint32_t opcode_inputs = 0;
+        /**
+         * The first input argument, and for `cxx_invoke` also the second, 
+         * belong to the invoking opcode; all input arguments of an opcode 
+         * registered with `cxx_append_opcode` are inputs.
+         */
+        static uint32_t count_opcode_inputs(const OPDS *opds_)
+        {
+            auto opcode_name = opds_->optext->t.opcod;
+            if (std::strcmp(opcode_name, "cxx_invoke") == 0) {
+                return 2;
+            }
+            if (std::strncmp(opcode_name, "cxx_invoke_", 11) == 0) {
+                return 1;
+            }
+            return 0;
+        }
+        int check_types(CSOUND *csound_, MYFLT **arguments, uint32_t count, const char *types, const char *direction)
+        {
+            if (opds == nullptr) {
+                csound_->Message(csound_, "Error: check_%s_types: called before CxxInvokableBase::init, e.g. in kontrol with thread 2.\n", direction);
+                return NOTOK;
+            }
+            if (arguments == nullptr) {
+                return csound_->InitError(csound_, "%s: the %ss were not passed to CxxInvokableBase::init.\n", 
+                    opds->optext->t.opcod, direction);
+            }
+            if (std::strlen(types) > count) {
+                return csound_->InitError(csound_, "%s: %d %ss were expected, but there are %d.\n", 
+                    opds->optext->t.opcod, (int) std::strlen(types), direction, (int) count);
+            }
+            for (uint32_t i = 0; types[i] != 0; ++i) {
+                char expected = types[i];
+                if (expected == '.') {
+                    continue;
+                }
+                auto type = csound_->GetTypeForArg(arguments[i]);
+                const char *type_name = type == nullptr ? "" : type->varTypeName;
+                char actual = type_name[0];
+                if (actual == 'i' || actual == 'c' || actual == 'p' || actual == 'r') {
+                    actual = 'k';
+                }
+                char array_name[0x40];
+                if (actual == '[') {
+                    // Arrays of strings or of other arrays have no view.
+                    auto member_type = ((ARRAYDAT *) arguments[i])->arrayType;
+                    auto member_name = member_type == nullptr ? "" : member_type->varTypeName;
+                    if (std::strcmp(member_name, "i") != 0 && std::strcmp(member_name, "k") != 0 && std::strcmp(member_name, "a") != 0) {
+                        actual = 0;
+                    }
+                    std::snprintf(array_name, sizeof(array_name), "%s[]", member_name);
+                    type_name = array_name;
+                }
+                if (actual != expected) {
+                    return csound_->InitError(csound_, "%s: %s %d has type \"%s\", but '%c' was expected.\n", 
+                        opds->optext->t.opcod, direction, (int) i + 1, type_name, expected);
+                }
+            }
+            return OK;
+        }
+};
+
+/**
+ * Describes how `cxx_invoke` can recycle instances of a `CxxInvokable`, 
+ * instead of allocating a new instance for every note and deleting it at 
+ * the end of the note. 
+ *
+ * To use pooling, a module that defines the factory `name` also defines 
+ * `extern "C" const CxxInvokablePool *name_pool()`, most easily with the 
+ * `CXX_INVOKABLE_POOL` macro. When the factory is first resolved, 
+ * `cxx_invoke` constructs `capacity` instances in one preallocated arena. 
+ * Notes then take instances from the pool, and return them to the pool 
+ * after `noteoff`, when `reset` is called. If the pool is empty, the factory 
+ * is called as usual.
+ */
+struct CxxInvokablePool {
+    size_t size;
+    size_t alignment;
+    size_t capacity;
+    CxxInvokable *(*construct)(void *memory);
+    void (*reset)(CxxInvokable *invokable);
+    void (*destroy)(CxxInvokable *invokable);
+};
+
+/**
+ * Returns the pool description for `T`, which must be default 
+ * constructible and should override `CxxInvokableBase::reset`.
+ */
+template<typename T>
+const CxxInvokablePool *cxx_invokable_pool(size_t capacity)
+{
+    static const CxxInvokablePool pool = {
+        sizeof(T),
+        alignof(T),
+        capacity,
+        [](void *memory) -> CxxInvokable * {
+            return new (memory) T();
+        },
+        [](CxxInvokable *invokable) {
+            static_cast<T *>(invokable)->reset();
+        },
+        [](CxxInvokable *invokable) {
+            static_cast<T *>(invokable)->~T();
+        },
+    };
+    return &pool;
+}
+
+/**
+ * Defines the pool description for the factory `factory_name`, which 
+ * creates instances of `T`, with room for `capacity` instances.
+ */
+#define CXX_INVOKABLE_POOL(factory_name, T, capacity) \
+    extern "C" const CxxInvokablePool *factory_name##_pool() { \
+        return cxx_invokable_pool<T>(capacity); \
+    }
+
+/**
+ * Declares that the factory `factory_name` creates instances that override 
+ * `CxxInvokable::migrate`, so that when the module is loaded by 
+ * `cxx_reload`, notes running the replaced factory are offered to new 
+ * instances. Without this declaration, running notes keep the old code 
+ * until their noteoff, and no instance is created for them.
+ */
+#define CXX_INVOKABLE_MIGRATES(factory_name) \
+    extern "C" int factory_name##_migrates() { \
+        return 1; \
+    }
+
+/**
+ * Opt-in interface for computing all active notes, or voices, of one factory
+ * in a single call, rather than in one `kontrol` call per note. This makes
+ * it possible to keep the state of all voices in structure-of-arrays layout,
+ * and to vectorize across voices.
+ *
+ * To use a voice bank, a module that defines the factory `name` defines
+ * `extern "C" CxxVoiceBank *name_voice_bank()` instead of, or as well as,
+ * the factory itself, most easily with the `CXX_VOICE_BANK` macro. Only one
+ * bank is created for the factory. Each note that invokes the factory adds a
+ * voice to the bank at init time, and removes it at noteoff. Every kperiod,
+ * the first note to be performed calls `process_voices`, which must compute
+ * the outputs of all voices. Notes that are performed later in the same
+ * kperiod do nothing, so their inputs are those from the previous kperiod.
+ *
+ * Calls to a bank are serialized by `cxx_invoke`.
+ */
+struct CxxVoiceBank {
+	virtual ~CxxVoiceBank() {};
+	/**
+	 * Called once at init time of a note, with the same arguments as
+	 * `CxxInvokable::init`. Returns the index of the new voice, or -1 if
+	 * the voice could not be added.
+	 */
+	virtual int add_voice(CSOUND *csound, OPDS *opds, MYFLT **outputs, MYFLT **inputs) = 0;
+	/**
+	 * Called once every kperiod. Computes the outputs of all voices.
+	 */
+	virtual int process_voices(CSOUND *csound) = 0;
+	/**
+	 * Called when the note that added the voice is turned off.
+	 */
+	virtual void remove_voice(CSOUND *csound, int voice) = 0;
+};
+
+/**
+ * Concrete base class that implements `CxxVoiceBank` for up to `VOICES`
+ * voices. Voice indexes are slots that derived classes can use to index
+ * their own arrays of voice state, and that are reused after a voice is
+ * removed. The active voices are kept densely packed, so that
+ * `process_voices` can loop from 0 to `voice_count()` over `voice(i)`.
+ */
+template<size_t VOICES>
+class CxxVoiceBankBase : public CxxVoiceBank {
+    public:
+        CxxVoiceBankBase()
+        {
+            for (size_t i = 0; i < VOICES; ++i) {
+                free_voices[i] = int(VOICES - 1 - i);
+            }
+        }
+        virtual ~CxxVoiceBankBase() {
+        };
+        int add_voice(CSOUND *csound_, OPDS *opds, MYFLT **outputs, MYFLT **inputs) override
+        {
+            csound = csound_;
+            if (free_count == 0) {
+                return -1;
+            }
+            int voice_ = free_voices[--free_count];
+            voice_opds[voice_] = opds;
+            voice_outputs[voice_] = outputs;
+            voice_inputs[voice_] = inputs;
+            positions[voice_] = active_count;
+            active_voices[active_count++] = voice_;
+            if (start_voice(voice_) != OK) {
+                remove_voice(csound, voice_);
+                return -1;
+            }
+            return voice_;
+        }
+        void remove_voice(CSOUND *csound_, int voice_) override
+        {
+            stop_voice(voice_);
+            auto position = positions[voice_];
+            auto last = active_voices[--active_count];
+            active_voices[position] = last;
+            positions[last] = position;
+            voice_opds[voice_] = nullptr;
+            voice_outputs[voice_] = nullptr;
+            voice_inputs[voice_] = nullptr;
+            free_voices[free_count++] = voice_;
+        }
+        /**
+         * Called when a voice is added, to initialize its state. Returns
+         * `OK` to accept the voice.
+         */
+        virtual int start_voice(int voice_)
+        {
+            return OK;
+        }
+        /**
+         * Called when a voice is removed.
+         */
+        virtual void stop_voice(int voice_)
+        {
+        }
+    protected:
+        /**
+         * Returns the number of active voices.
+         */
+        size_t voice_count() const
+        {
+            return active_count;
+        }
+        /**
+         * Returns the index of the ith active voice.
+         */
+        int voice(size_t i) const
+        {
+            return active_voices[i];
+        }
+        /**
+         * Returns the instrument instance that owns the voice, which
+         * identifies the note.
+         */
+        INSDS *voice_instrument(int voice_) const
+        {
+            return voice_opds[voice_]->insdshead;
+        }
+        MYFLT *output(int voice_, size_t index) const
+        {
+            return voice_outputs[voice_][index];
+        }
+        MYFLT *input(int voice_, size_t index) const
+        {
+            return voice_inputs[voice_][index];
+        }
+        uint32_t kperiodOffset(int voice_) const
+        {
+            return voice_instrument(voice_)->ksmps_offset;
+        }
+        /**
+         * Returns the index after the last sample of the kperiod that is to 
+         * be computed for the voice, as `CxxInvokableBase::kperiodEnd` does.
+         */
+        uint32_t kperiodEnd(int voice_) const
+        {
+            uint32_t no_end = voice_instrument(voice_)->ksmps_no_end;
+            uint32_t ksmps_ = ksmps(voice_);
+            return no_end < ksmps_ ? ksmps_ - no_end : 0;
+        }
+        uint32_t ksmps(int voice_) const
+        {
+            return voice_instrument(voice_)->ksmps;
+        }
+        CSOUND *csound = nullptr;
+        OPDS *voice_opds[VOICES] = {};
+        MYFLT **voice_outputs[VOICES] = {};
+        MYFLT **voice_inputs[VOICES] = {};
+    private:
+        int free_voices[VOICES];
+        size_t free_count = VOICES;
+        int active_voices[VOICES];
+        size_t positions[VOICES];
+        size_t active_count = 0;
+};
+
+/**
+ * Defines the voice bank for the factory `factory_name`, which must be
+ * a default constructible class `T` that implements `CxxVoiceBank`.
+ */
+#define CXX_VOICE_BANK(factory_name, T) \
+    extern "C" CxxVoiceBank *factory_name##_voice_bank() { \
+        return new T(); \
+    }
+
+#if defined(__AVX__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#if defined(_MSC_VER)
+#define CXX_RESTRICT __restrict
+#else
+#define CXX_RESTRICT __restrict__
+#endif
+
+/**
+ * Vectorized kernels for common operations on blocks of audio samples. 
+ * Depending on the compiler options used for the module, these use AVX, 
+ * SSE2, or NEON, or else plain loops that the compiler can vectorize. The 
+ * blocks need not be aligned, but must not overlap, except that the output 
+ * may be the same as an input. When the output is not an input, the loops 
+ * use restrict-qualified pointers.
+ */
+namespace cxx_simd {
+
+#if defined(USE_DOUBLE)
+#if defined(__AVX__)
+    typedef __m256d vector_t;
+    enum { WIDTH = 4 };
+    inline vector_t load(const MYFLT *data) { return _mm256_loadu_pd(data); }
+    inline void store(MYFLT *data, vector_t value) { _mm256_storeu_pd(data, value); }
+    inline vector_t broadcast(MYFLT value) { return _mm256_set1_pd(value); }
+    inline vector_t add(vector_t a, vector_t b) { return _mm256_add_pd(a, b); }
+    inline vector_t multiply(vector_t a, vector_t b) { return _mm256_mul_pd(a, b); }
+#if defined(__FMA__)
+    inline vector_t multiply_add(vector_t a, vector_t b, vector_t c) { return _mm256_fmadd_pd(a, b, c); }
+#else
+    inline vector_t multiply_add(vector_t a, vector_t b, vector_t c) { return _mm256_add_pd(_mm256_mul_pd(a, b), c); }
+#endif
+#elif defined(__SSE2__)
+    typedef __m128d vector_t;
+    enum { WIDTH = 2 };
+    inline vector_t load(const MYFLT *data) { return _mm_loadu_pd(data); }
+    inline void store(MYFLT *data, vector_t value) { _mm_storeu_pd(data, value); }
+    inline vector_t broadcast(MYFLT value) { return _mm_set1_pd(value); }
+    inline vector_t add(vector_t a, vector_t b) { return _mm_add_pd(a, b); }
+    inline vector_t multiply(vector_t a, vector_t b) { return _mm_mul_pd(a, b); }
+    inline vector_t multiply_add(vector_t a, vector_t b, vector_t c) { return _mm_add_pd(_mm_mul_pd(a, b), c); }
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    typedef float64x2_t vector_t;
+    enum { WIDTH = 2 };
+    inline vector_t load(const MYFLT *data) { return vld1q_f64(data); }
+    inline void store(MYFLT *data, vector_t value) { vst1q_f64(data, value); }
+    inline vector_t broadcast(MYFLT value) { return vdupq_n_f64(value); }
+    inline vector_t add(vector_t a, vector_t b) { return vaddq_f64(a, b); }
+    inline vector_t multiply(vector_t a, vector_t b) { return vmulq_f64(a, b); }
+    inline vector_t multiply_add(vector_t a, vector_t b, vector_t c) { return vfmaq_f64(c, a, b); }
+#else
+#define CXX_SIMD_SCALAR
+#endif
+#else
+#if defined(__AVX__)
+    typedef __m256 vector_t;
+    enum { WIDTH = 8 };
+    inline vector_t load(const MYFLT *data) { return _mm256_loadu_ps(data); }
+    inline void store(MYFLT *data, vector_t value) { _mm256_storeu_ps(data, value); }
+    inline vector_t broadcast(MYFLT value) { return _mm256_set1_ps(value); }
+    inline vector_t add(vector_t a, vector_t b) { return _mm256_add_ps(a, b); }
+    inline vector_t multiply(vector_t a, vector_t b) { return _mm256_mul_ps(a, b); }
+#if defined(__FMA__)
+    inline vector_t multiply_add(vector_t a, vector_t b, vector_t c) { return _mm256_fmadd_ps(a, b, c); }
+#else
+    inline vector_t multiply_add(vector_t a, vector_t b, vector_t c) { return _mm256_add_ps(_mm256_mul_ps(a, b), c); }
+#endif
+#elif defined(__SSE2__)
+    typedef __m128 vector_t;
+    enum { WIDTH = 4 };
+    inline vector_t load(const MYFLT *data) { return _mm_loadu_ps(data); }
+    inline void store(MYFLT *data, vector_t value) { _mm_storeu_ps(data, value); }
+    inline vector_t broadcast(MYFLT value) { return _mm_set1_ps(value); }
+    inline vector_t add(vector_t a, vector_t b) { return _mm_add_ps(a, b); }
+    inline vector_t multiply(vector_t a, vector_t b) { return _mm_mul_ps(a, b); }
+    inline vector_t multiply_add(vector_t a, vector_t b, vector_t c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+#elif defined(__ARM_NEON)
+    typedef float32x4_t vector_t;
+    enum { WIDTH = 4 };
+    inline vector_t load(const MYFLT *data) { return vld1q_f32(data); }
+    inline void store(MYFLT *data, vector_t value) { vst1q_f32(data, value); }
+    inline vector_t broadcast(MYFLT value) { return vdupq_n_f32(value); }
+    inline vector_t add(vector_t a, vector_t b) { return vaddq_f32(a, b); }
+    inline vector_t multiply(vector_t a, vector_t b) { return vmulq_f32(a, b); }
+    inline vector_t multiply_add(vector_t a, vector_t b, vector_t c) { return vmlaq_f32(c, a, b); }
+#else
+#define CXX_SIMD_SCALAR
+#endif
+#endif
+
+    /**
+     * output[i] = value
+     */
+    inline void fill(MYFLT *CXX_RESTRICT output, MYFLT value, uint32_t frames)
+    {
+        uint32_t i = 0;
+#if !defined(CXX_SIMD_SCALAR)
+        auto value_ = broadcast(value);
+        for ( ; i + WIDTH <= frames; i += WIDTH) {
+            store(output + i, value_);
+        }
+#endif
+        for ( ; i < frames; ++i) {
+            output[i] = value;
+        }
+    }
+    /**
+     * output[i] = input[i]
+     */
+    inline void copy(MYFLT *CXX_RESTRICT output, const MYFLT *CXX_RESTRICT input, uint32_t frames)
+    {
+        if (output != input) {
+            std::memcpy(output, input, frames * sizeof(MYFLT));
+        }
+    }
+    /**
+     * output[i] = input[i] * gain_
+     */
+    inline void gain(MYFLT *output, const MYFLT *input, MYFLT gain_, uint32_t frames)
+    {
+        uint32_t i = 0;
+#if !defined(CXX_SIMD_SCALAR)
+        auto gain_vector = broadcast(gain_);
+        for ( ; i + WIDTH <= frames; i += WIDTH) {
+            store(output + i, multiply(load(input + i), gain_vector));
+        }
+#endif
+        if (output != input) {
+            MYFLT *CXX_RESTRICT output_ = output;
+            const MYFLT *CXX_RESTRICT input_ = input;
+            for ( ; i < frames; ++i) {
+                output_[i] = input_[i] * gain_;
+            }
+        } else {
+            for ( ; i < frames; ++i) {
+                output[i] *= gain_;
+            }
+        }
+    }
+    /**
+     * output[i] += input[i] * gain_
+     */
+    inline void mix(MYFLT *output, const MYFLT *input, MYFLT gain_, uint32_t frames)
+    {
+        uint32_t i = 0;
+#if !defined(CXX_SIMD_SCALAR)
+        auto gain_vector = broadcast(gain_);
+        for ( ; i + WIDTH <= frames; i += WIDTH) {
+            store(output + i, multiply_add(load(input + i), gain_vector, load(output + i)));
+        }
+#endif
+        if (output != input) {
+            MYFLT *CXX_RESTRICT output_ = output;
+            const MYFLT *CXX_RESTRICT input_ = input;
+            for ( ; i < frames; ++i) {
+                output_[i] += input_[i] * gain_;
+            }
+        } else {
+            for ( ; i < frames; ++i) {
+                output[i] += output[i] * gain_;
+            }
+        }
+    }
+    /**
+     * output[i] = a[i] * b[i]
+     */
+    inline void multiply(MYFLT *output, const MYFLT *a, const MYFLT *b, uint32_t frames)
+    {
+        uint32_t i = 0;
+#if !defined(CXX_SIMD_SCALAR)
+        for ( ; i + WIDTH <= frames; i += WIDTH) {
+            store(output + i, multiply(load(a + i), load(b + i)));
+        }
+#endif
+        if (output != a && output != b) {
+            MYFLT *CXX_RESTRICT output_ = output;
+            const MYFLT *CXX_RESTRICT a_ = a;
+            const MYFLT *CXX_RESTRICT b_ = b;
+            for ( ; i < frames; ++i) {
+                output_[i] = a_[i] * b_[i];
+            }
+        } else {
+            for ( ; i < frames; ++i) {
+                output[i] = a[i] * b[i];
+            }
+        }
+    }
+    /**
+     * output[i] += a[i] * b[i]
+     */
+    inline void multiply_add(MYFLT *output, const MYFLT *a, const MYFLT *b, uint32_t frames)
+    {
+        uint32_t i = 0;
+#if !defined(CXX_SIMD_SCALAR)
+        for ( ; i + WIDTH <= frames; i += WIDTH) {
+            store(output + i, multiply_add(load(a + i), load(b + i), load(output + i)));
+        }
+#endif
+        if (output != a && output != b) {
+            MYFLT *CXX_RESTRICT output_ = output;
+            const MYFLT *CXX_RESTRICT a_ = a;
+            const MYFLT *CXX_RESTRICT b_ = b;
+            for ( ; i < frames; ++i) {
+                output_[i] += a_[i] * b_[i];
+            }
+        } else {
+            for ( ; i < frames; ++i) {
+                output[i] += a[i] * b[i];
+            }
+        }
+    }
+
+}
+
+/**
+ * The audio signals of one direction of a `CxxBlockInvokable`, trimmed to 
+ * the frames of the kperiod that are actually to be computed, i.e. from 
+ * `kperiodOffset()` to `kperiodEnd()`.
+ *
+ * The channels are neither aligned nor restrict-qualified. They begin at 
+ * `kperiodOffset()`, which may be any sample, and Csound may pass the same 
+ * audio variable as an input and as an output of the opcode. A `process` 
+ * that knows its outputs are not its inputs can copy the channels into 
+ * local `MYFLT *CXX_RESTRICT` pointers for its loops; the `cxx_simd` kernels 
+ * do that whenever their output is not one of their inputs.
+ */
+template<size_t CHANNELS>
+struct AudioBlock {
+    MYFLT *channels[CHANNELS];
+    uint32_t frames;
+    MYFLT *channel(size_t index) const
+    {
+        return channels[index];
+    }
+    static constexpr size_t channel_count()
+    {
+        return CHANNELS;
+    }
+};
+
+/**
+ * Base class for `CxxInvokable`s that process blocks of audio. The first 
+ * `OUTPUTS` outputs of the opcode must be a-rate, as must the `INPUTS` inputs 
+ * starting at input `FIRST_INPUT`; any inputs before that, e.g. k-rate 
+ * control parameters, are available from `control_input`.
+ *
+ * Every kperiod, this class zeroes the output samples that fall before 
+ * `kperiodOffset()` or from `kperiodEnd()` on, and then calls `process` with 
+ * blocks that begin at `kperiodOffset()` and contain only the frames to be 
+ * computed. Derived classes override `process` instead of `kontrol`, and 
+ * can use the `cxx_simd` kernels, or loops over the trimmed blocks that the 
+ * compiler can vectorize.
+ */
+template<size_t INPUTS, size_t OUTPUTS, size_t FIRST_INPUT = 0>
+class CxxBlockInvokable : public CxxInvokableBase {
+    public:
+        int kontrol(CSOUND *csound_, MYFLT **outputs, MYFLT **inputs) override
+        {
+            kontrol_inputs = inputs;
+            uint32_t frames = ksmps();
+            uint32_t offset = std::min(kperiodOffset(), frames);
+            uint32_t end = kperiodEnd();
+            AudioBlock<INPUTS> input_block;
+            AudioBlock<OUTPUTS> output_block;
+            input_block.frames = end > offset ? end - offset : 0;
+            output_block.frames = input_block.frames;
+            for (size_t i = 0; i < OUTPUTS; ++i) {
+                if (offset) {
+                    std::memset(outputs[i], 0, offset * sizeof(MYFLT));
+                }
+                if (end < frames) {
+                    std::memset(outputs[i] + end, 0, (frames - end) * sizeof(MYFLT));
+                }
+                output_block.channels[i] = outputs[i] + offset;
+            }
+            for (size_t i = 0; i < INPUTS; ++i) {
+                input_block.channels[i] = inputs[FIRST_INPUT + i] + offset;
+            }
+            return process(input_block, output_block);
+        }
+        /**
+         * Computes one kperiod of audio.
+         */
+        virtual int process(const AudioBlock<INPUTS> &inputs, AudioBlock<OUTPUTS> &outputs) = 0;
+    protected:
+        /**
+         * Returns the current value of a non-audio input of the opcode.
+         */
+        MYFLT control_input(size_t index) const
+        {
+            return *kontrol_inputs[index];
+        }
+        MYFLT **kontrol_inputs = nullptr;
+};
+
+/**
+ * Adapts the `CxxInvokable` class `T` to a native Csound opcode, so that 
+ * the orchestra calls it by its own name, without `cxx_invoke`. `OUTPUTS` 
+ * and `INPUTS` must be the numbers of arguments in the output and input 
+ * type strings of the opcode, as for the argument pointers of an opcode in 
+ * a plugin; for variable numbers of arguments, the maximum number.
+ *
+ * The instance of `T`, which must be default constructible, is stored in 
+ * the opcode itself. It is constructed at the first init of the note, and 
+ * destroyed at its noteoff. Its `init` and `kontrol` are called directly, 
+ * not through the vtable; as for `cxx_invoke`, `THREAD` 2 does not call 
+ * `init`, `THREAD` 1 does not call `kontrol`, and `noteoff` is always 
+ * called, as `CxxInvokable::noteoff` describes.
+ */
+template<typename T, size_t OUTPUTS, size_t INPUTS, int THREAD = 3>
+struct CxxOpcode {
+    static_assert(alignof(T) <= alignof(std::max_align_t), "CxxOpcode: the invokable is aligned more strictly than Csound allocates opcodes.");
+    OPDS opds;
+    // The outputs followed by the inputs.
+    MYFLT *arguments[OUTPUTS + INPUTS];
+    alignas(T) unsigned char storage[sizeof(T)];
+    bool constructed;
+    T *invokable()
+    {
+        return reinterpret_cast<T *>(storage);
+    }
+    static int init_(CSOUND *csound, void *opcode_)
+    {
+        auto opcode = reinterpret_cast<CxxOpcode *>(opcode_);
+        // Csound zeroes the opcode when it is allocated, and calls init 
+        // again on reinit, and for a tied note.
+        if (opcode->constructed == false) {
+            new (opcode->storage) T();
+            opcode->constructed = true;
+            csound->RegisterDeinitCallback(csound, opcode, &CxxOpcode::noteoff_);
+        }
+        if (THREAD == 2) {
+            return OK;
+        }
+        return opcode->invokable()->T::init(csound, &opcode->opds, opcode->arguments, opcode->arguments + OUTPUTS);
+    }
+    static int kontrol_(CSOUND *csound, void *opcode_)
+    {
+        auto opcode = reinterpret_cast<CxxOpcode *>(opcode_);
+        return opcode->invokable()->T::kontrol(csound, opcode->arguments, opcode->arguments + OUTPUTS);
+    }
+    static int noteoff_(CSOUND *csound, void *opcode_)
+    {
+        auto opcode = reinterpret_cast<CxxOpcode *>(opcode_);
+        if (opcode->constructed == false) {
+            return OK;
+        }
+        int result = opcode->invokable()->T::noteoff(csound);
+        opcode->invokable()->~T();
+        opcode->constructed = false;
+        return result;
+    }
+};
+
+/**
+ * Registers `CxxOpcode<T, OUTPUTS, INPUTS, THREAD>` as the Csound opcode 
+ * `name` with the output and input type strings, e.g. 
+ * `cxx_append_opcode<Reverb, 2, 4>(csound, "myreverb", "aa", "aakk")` in the 
+ * entry point of a module. The opcode can only be used by orchestra code that 
+ * is compiled afterwards, e.g. by `compilestr`. Because Csound cannot remove 
+ * an opcode, `cxx_compile` keeps a module that registers opcodes loaded 
+ * until the Csound instance is destroyed, even if it is unloaded by 
+ * `cxx_unload` or replaced by `cxx_reload`. Returns the status of 
+ * `csound->AppendOpcode`.
+ */
+template<typename T, size_t OUTPUTS, size_t INPUTS, int THREAD = 3>
+int cxx_append_opcode(CSOUND *csound, const char *name, const char *outypes, const char *intypes)
+{
+    typedef CxxOpcode<T, OUTPUTS, INPUTS, THREAD> opcode_t;
+    static_assert(sizeof(opcode_t) <= 0xffff, "CxxOpcode: the invokable is too large to be stored in an opcode; allocate its state in init.");
+    auto opcode_count = (int *) csound->QueryGlobalVariable(csound, "cxx_opcodes_native_opcodes");
+    if (opcode_count != nullptr) {
+        (*opcode_count)++;
+    }
+    return csound->AppendOpcode(csound,
+                                (char *)name,
+                                sizeof(opcode_t),
+                                0,
+                                THREAD,
+                                (char *)outypes,
+                                (char *)intypes,
+                                (int (*)(CSOUND*,void*)) opcode_t::init_,
+                                THREAD == 1 ? (int (*)(CSOUND*,void*)) 0 : (int (*)(CSOUND*,void*)) opcode_t::kontrol_,
+                                (int (*)(CSOUND*,void*)) 0);
+}
+
+/**
+ * Stages score events with numeric p-fields, and sends them to Csound in one 
+ * batch, without formatting them as text or parsing them again as 
+ * `csound->InputMessage` does. This is intended for score generators that 
+ * create many events, e.g. in the entry point of a module:
+ *
+ *     CxxScoreBuffer buffer;
+ *     buffer.reserve(notes.size(), 7);
+ *     for (const auto &note : notes) {
+ *         buffer.add('i', {note.instrument, note.time, note.duration, ...});
+ *     }
+ *     buffer.sort();
+ *     buffer.send(csound, true);
+ *
+ * P-fields are numbered from 1, as in the score; times are in seconds, 
+ * relative to the current time of performance, as for line events. String 
+ * p-fields are not supported. `send` must be called from a Csound thread, 
+ * e.g. in the entry point of a module or in an opcode, because it inserts 
+ * events directly into the event queue of Csound.
+ */
+class CxxScoreBuffer {
+    public:
+        /**
+         * Preallocates room for `events` events of `pfields` p-fields each.
+         */
+        void reserve(size_t events, size_t pfields)
+        {
+            events_.reserve(events);
+            pfields_.reserve(events * pfields);
+        }
+        /**
+         * Stages one event, e.g. 'i', 'f', or 'e', with the p-fields 
+         * `pfields[0]` to `pfields[count - 1]`, i.e. p1 to p<count>. Returns 
+         * false, and stages nothing, if there are more than `PMAX` p-fields.
+         */
+        bool add(char opcode, const MYFLT *pfields, size_t count)
+        {
+            if (count > PMAX) {
+                return false;
+            }
+            Event event;
+            event.opcode = opcode;
+            event.offset = pfields_.size();
+            event.count = (uint16_t) count;
+            event.start = count > 1 ? pfields[1] : MYFLT(0);
+            events_.push_back(event);
+            pfields_.insert(pfields_.end(), pfields, pfields + count);
+            sorted = false;
+            return true;
+        }
+        bool add(char opcode, std::initializer_list<MYFLT> pfields)
+        {
+            return add(opcode, pfields.begin(), pfields.size());
+        }
+        /**
+         * Sorts the staged events by start time (p2), keeping events with the 
+         * same start time in the order that they were added, and Csound 
+         * receives them in that order. Csound keeps its event queue sorted 
+         * by time, so the events of different kperiods are sent in constant 
+         * time per event, rather than in time proportional to the number of 
+         * events that are already queued.
+         */
+        void sort()
+        {
+            std::stable_sort(events_.begin(), events_.end(), [](const Event &a, const Event &b) {
+                return a.start < b.start;
+            });
+            sorted = true;
+        }
+        size_t size() const
+        {
+            return events_.size();
+        }
+        void clear()
+        {
+            events_.clear();
+            pfields_.clear();
+            sorted = true;
+        }
+        /**
+         * Sends all staged events to Csound, and clears the buffer. Returns 
+         * the number of events that Csound accepted. If `report` is true, 
+         * logs the number of events and the rate at which they were sent.
+         */
+        size_t send(CSOUND *csound, bool report = false)
+        {
+            auto began = std::chrono::steady_clock::now();
+            auto now = csound->GetCurrentTimeSamples(csound);
+            size_t sent = 0;
+            if (sorted == false) {
+                for (const auto &event : events_) {
+                    sent += send_(csound, event, now);
+                }
+            } else {
+                // Csound searches its event queue for the place of a new 
+                // event from the earliest event, and puts it after the events 
+                // of the same kperiod. So the kperiods are sent from the 
+                // latest to the earliest, each at the head of the queue, and 
+                // the events of each kperiod in sorted order, each after the 
+                // one before.
+                auto sr = (double) csound->GetSr(csound);
+                auto kr = (double) csound->GetKr(csound);
+                auto kperiod = [&](const Event &event) {
+                    // As Csound computes the kperiod of an event.
+                    double start_time = (double) event.start + (double) now / sr;
+                    return start_time > 0. ? (uint64_t) (start_time * kr) : uint64_t(0);
+                };
+                size_t end = events_.size();
+                while (end > 0) {
+                    size_t begin = end - 1;
+                    auto kperiod_ = kperiod(events_[begin]);
+                    while (begin > 0 && kperiod(events_[begin - 1]) == kperiod_) {
+                        --begin;
+                    }
+                    for (size_t i = begin; i < end; ++i) {
+                        sent += send_(csound, events_[i], now);
+                    }
+                    end = begin;
+                }
+            }
+            if (report) {
+                std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - began;
+                double seconds = elapsed.count();
+                csound->Message(csound, "cxx_score: sent %zu of %zu events in %.3f ms (%.0f events per second).\n", 
+                    sent, events_.size(), seconds * 1000., seconds > 0. ? sent / seconds : 0.);
+            }
+            clear();
+            return sent;
+        }
+    private:
+        struct Event {
+            char opcode;
+            uint16_t count;
+            size_t offset;
+            MYFLT start;
+        };
+        /**
+         * Inserts one event into the event queue of Csound. Returns 1 if 
+         * Csound accepted it, or 0.
+         */
+        size_t send_(CSOUND *csound, const Event &event, int64_t now)
+        {
+            evtblk.strarg = nullptr;
+            evtblk.scnt = 0;
+            evtblk.opcod = event.opcode;
+            evtblk.pcnt = (int16) event.count;
+            evtblk.p[0] = FL(0.0);
+            std::memcpy(&evtblk.p[1], pfields_.data() + event.offset, event.count * sizeof(MYFLT));
+            evtblk.p2orig = event.count > 1 ? evtblk.p[2] : FL(0.0);
+            evtblk.p3orig = event.count > 2 ? evtblk.p[3] : FL(0.0);
+            return csound->insert_score_event_at_sample(csound, &evtblk, now) == 0 ? 1 : 0;
+        }
+        std::vector<Event> events_;
+        std::vector<MYFLT> pfields_;
+        bool sorted = true;
+        EVTBLK evtblk;
+};
+
+/**
+ * The registry of the named buses of one Csound instance, which modules use 
+ * to share data without Csound channels. It is owned by the cxx opcodes, 
+ * and is stored in the Csound global variable `cxx_opcodes_buses`. Modules 
+ * should not call it directly, but use `cxx_bus`.
+ *
+ * `acquire` returns the bus `name`, creating it if it does not yet exist, in 
+ * zeroed memory of `size` bytes aligned to `alignment`, by calling 
+ * `construct`. If the bus exists but its `kind` or `size` differ, it returns 
+ * null. Buses are never moved, and are deleted only when the Csound 
+ * instance is destroyed, without calling their destructors, so they remain 
+ * valid even after the module that created them is unloaded.
+ */
+struct CxxBusRegistry {
+    void *(*acquire)(CSOUND *csound, const char *name, const char *kind, size_t size, size_t alignment, void (*construct)(void *memory));
+};
+
+/**
+ * Returns the bus `name` of the type `Bus`, which is one of `CxxBusBuffer`, 
+ * `CxxBusSpscQueue`, `CxxBusMpscQueue`, or `CxxBusSnapshot`, creating it if 
+ * it does not yet exist. Returns null if the cxx opcodes are not loaded, or 
+ * if another module has already created a bus with that name and a 
+ * different type, value size, or capacity. The lookup takes a lock, so it 
+ * should be done once, e.g. in `init`; the bus itself is then used at k-rate 
+ * without locks, allocation, or copies into channels.
+ */
+template<typename Bus>
+Bus *cxx_bus(CSOUND *csound, const char *name)
+{
+    static_assert(std::is_trivially_destructible<Bus>::value, "cxx_bus: the bus must be trivially destructible.");
+    auto registry = (CxxBusRegistry *) csound->QueryGlobalVariable(csound, "cxx_opcodes_buses");
+    if (registry == nullptr || registry->acquire == nullptr) {
+        return nullptr;
+    }
+    char kind[0x100];
+    std::snprintf(kind, sizeof(kind), "%s<%zu,%zu,%zu>", Bus::kind, sizeof(typename Bus::value_type), alignof(typename Bus::value_type), Bus::capacity);
+    return (Bus *) registry->acquire(csound, name, kind, sizeof(Bus), alignof(Bus), [](void *memory) {
+        new (memory) Bus();
+    });
+}
+
+/**
+ * Keeps the indexes of a bus that are written by different threads on 
+ * different cache lines.
+ */
+#define CXX_BUS_CACHE_LINE 64
+
+/**
+ * A preallocated array of `N` values of type `T`, e.g. a table or a block 
+ * of audio that one module writes and others read. The buffer itself does 
+ * not synchronize its readers and writers.
+ */
+template<typename T, size_t N>
+struct CxxBusBuffer {
+    static_assert(std::is_trivially_copyable<T>::value, "CxxBusBuffer: the value type must be trivially copyable.");
+    typedef T value_type;
+    static constexpr const char *kind = "CxxBusBuffer";
+    static constexpr size_t capacity = N;
+    T *data()
+    {
+        return values;
+    }
+    constexpr size_t size() const
+    {
+        return N;
+    }
+    T &operator[](size_t index)
+    {
+        return values[index];
+    }
+    T values[N];
+};
+
+/**
+ * A lock-free queue of up to `N` values of type `T`, which must be a power 
+ * of 2, for one writing thread and one reading thread.
+ */
+template<typename T, size_t N>
+struct CxxBusSpscQueue {
+    static_assert(std::is_trivially_copyable<T>::value, "CxxBusSpscQueue: the value type must be trivially copyable.");
+    static_assert(N > 0 && (N & (N - 1)) == 0, "CxxBusSpscQueue: the capacity must be a power of 2.");
+    typedef T value_type;
+    static constexpr const char *kind = "CxxBusSpscQueue";
+    static constexpr size_t capacity = N;
+    /**
+     * Returns false if the queue is full.
+     */
+    bool push(const T &value)
+    {
+        auto tail_ = tail.load(std::memory_order_relaxed);
+        if (tail_ - head.load(std::memory_order_acquire) == N) {
+            return false;
+        }
+        values[tail_ & (N - 1)] = value;
+        tail.store(tail_ + 1, std::memory_order_release);
+        return true;
+    }
+    /**
+     * Returns false if the queue is empty.
+     */
+    bool pop(T &value)
+    {
+        auto head_ = head.load(std::memory_order_relaxed);
+        if (head_ == tail.load(std::memory_order_acquire)) {
+            return false;
+        }
+        value = values[head_ & (N - 1)];
+        head.store(head_ + 1, std::memory_order_release);
+        return true;
+    }
+    size_t size() const
+    {
+        return tail.load(std::memory_order_acquire) - head.load(std::memory_order_acquire);
+    }
+    alignas(CXX_BUS_CACHE_LINE) std::atomic<size_t> head{0};
+    alignas(CXX_BUS_CACHE_LINE) std::atomic<size_t> tail{0};
+    alignas(CXX_BUS_CACHE_LINE) T values[N];
+};
+
+/**
+ * A lock-free queue of up to `N` values of type `T`, which must be a power 
+ * of 2, for any number of writing threads and one reading thread, e.g. 
+ * many voices sending events to one analyzer. A writer that is preempted 
+ * while pushing delays the reader, but not the other writers.
+ */
+template<typename T, size_t N>
+struct CxxBusMpscQueue {
+    static_assert(std::is_trivially_copyable<T>::value, "CxxBusMpscQueue: the value type must be trivially copyable.");
+    static_assert(N > 0 && (N & (N - 1)) == 0, "CxxBusMpscQueue: the capacity must be a power of 2.");
+    typedef T value_type;
+    static constexpr const char *kind = "CxxBusMpscQueue";
+    static constexpr size_t capacity = N;
+    CxxBusMpscQueue()
+    {
+        for (size_t i = 0; i < N; ++i) {
+            cells[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+    /**
+     * Returns false if the queue is full.
+     */
+    bool push(const T &value)
+    {
+        auto tail_ = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Cell &cell = cells[tail_ & (N - 1)];
+            auto difference = (std::ptrdiff_t) (cell.sequence.load(std::memory_order_acquire) - tail_);
+            if (difference == 0) {
+                if (tail.compare_exchange_weak(tail_, tail_ + 1, std::memory_order_relaxed)) {
+                    cell.value = value;
+                    cell.sequence.store(tail_ + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (difference < 0) {
+                return false;
+            } else {
+                tail_ = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+    /**
+     * Returns false if the queue is empty, or if the next value is still 
+     * being pushed.
+     */
+    bool pop(T &value)
+    {
+        auto head_ = head.load(std::memory_order_relaxed);
+        Cell &cell = cells[head_ & (N - 1)];
+        if (cell.sequence.load(std::memory_order_acquire) != head_ + 1) {
+            return false;
+        }
+        value = cell.value;
+        cell.sequence.store(head_ + N, std::memory_order_release);
+        head.store(head_ + 1, std::memory_order_relaxed);
+        return true;
+    }
+    struct Cell {
+        std::atomic<size_t> sequence;
+        T value;
+    };
+    alignas(CXX_BUS_CACHE_LINE) std::atomic<size_t> head{0};
+    alignas(CXX_BUS_CACHE_LINE) std::atomic<size_t> tail{0};
+    alignas(CXX_BUS_CACHE_LINE) Cell cells[N];
+};
+
+/**
+ * Triple-buffered snapshots of a value of type `T`, e.g. a spectrum or a 
+ * set of parameters, for one writing thread and one reading thread. The 
+ * writer fills `write()` and then calls `publish()`; the reader calls 
+ * `read()`, which returns the most recently published snapshot. Neither 
+ * ever waits for the other, copies the value, or sees a snapshot that is 
+ * being written.
+ */
+template<typename T>
+struct CxxBusSnapshot {
+    static_assert(std::is_trivially_copyable<T>::value, "CxxBusSnapshot: the value type must be trivially copyable.");
+    typedef T value_type;
+    static constexpr const char *kind = "CxxBusSnapshot";
+    static constexpr size_t capacity = 1;
+    /**
+     * Returns the buffer that the writer is to fill with the next snapshot.
+     */
+    T &write()
+    {
+        return buffers[back];
+    }
+    /**
+     * Publishes the buffer returned by `write()`.
+     */
+    void publish()
+    {
+        back = middle.exchange(back | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+    /**
+     * Returns the most recently published snapshot, which remains valid 
+     * until the next call of `read()`.
+     */
+    const T &read()
+    {
+        if (middle.load(std::memory_order_relaxed) & FRESH) {
+            front = middle.exchange(front, std::memory_order_acq_rel) & INDEX;
+        }
+        return buffers[front];
+    }
+    /**
+     * Returns true if a snapshot has been published since the last call of 
+     * `read()`.
+     */
+    bool fresh() const
+    {
+        return (middle.load(std::memory_order_relaxed) & FRESH) != 0;
+    }
+    enum : unsigned { INDEX = 3, FRESH = 4 };
+    // The index of the buffer between the writer and the reader, and 
+    // whether it holds a snapshot that the reader has not yet taken.
+    alignas(CXX_BUS_CACHE_LINE) std::atomic<unsigned> middle{1};
+    alignas(CXX_BUS_CACHE_LINE) unsigned back = 0;
+    alignas(CXX_BUS_CACHE_LINE) unsigned front = 2;
+    alignas(CXX_BUS_CACHE_LINE) T buffers[3];
 };
@@ -40,29 +40,63 @@
 #if defined(__APPLE__)
 #include <unistd.h>
 #endif
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
 #include <csdl.h>
+#include "cxx_invokable.hpp"
 #include <csignal>
 #include <csound.h>
+#include <cstdarg>
 #include <OpcodeBase.hpp>
 #include <cstdio>
 #include <cstdlib>
+#include <condition_variable>
+#include <cstring>
 #if (defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION))
 #include <dlfcn.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <sys/file.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#if defined(__APPLE__)
+#include <crt_externs.h>
+#define environ (*_NSGetEnviron())
+#else
+extern char **environ;
+#endif
 #endif
+#if defined(__linux__)
+#include <sys/mman.h>
+#endif
+#include <deque>
 #include <filesystem>
+#include <map>
 #include <memory>
 #include <mutex>
+#include <numeric>
 #include <random>
+#include <set>
 #include <stdlib.h>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 #if defined(WIN32)
 #include <windows.h>
 #endif
 
 /**
- * Diagnostics are global for all these opcodes, and also for 
- * all modules compiled by these opcodes.
+ * The diagnostics setting of the most recent compilation in this process, 
+ * for modules compiled by these opcodes. The opcodes themselves use the 
+ * setting of their own Csound instance, `CxxContext::diagnostics_enabled`.
  */
 PUBLIC bool &cxx_diagnostics_enabled() {
     static bool enabled = false;
@@ -83,10 +117,21 @@ static void *cxx_load_library(const char *library_name) {
 #if (defined(__APPLE__) || defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION))
     library_handle = dlopen(library_name, RTLD_NOW | RTLD_GLOBAL);
 #endif
-    std::fprintf(stderr, "####### cxx_load_library: library_name: %s library_handle: %p\n", library_name, library_handle);
     return library_handle;
 }
 
+/**
+ * Unloads a shared library loaded by `cxx_load_library`.
+ */
+static void cxx_unload_library(void *library_handle) {
+#if defined(WIN32)
+    FreeLibrary((HMODULE) library_handle);
+#endif
+#if (defined(__APPLE__) || defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION))
+    dlclose(library_handle);
+#endif
+}
+
 static void tokenize(std::string const &string_, const char delimiter, std::vector<std::string> &tokens) {
     size_t start;
     size_t end = 0;
@@ -98,153 +143,3499 @@ static void tokenize(std::string const &string_, const char delimiter, std::vect
 }
 
 /**
- * This contains handles to all dynamic link libraries compiled and loaded by 
- * these opcodes in this Csound process.
+ * Returns a string that can be used to make filenames unique across 
+ * threads and processes.
+ */
+static std::string unique_suffix() {
+    static std::atomic<unsigned long> counter{0};
+    static const unsigned long long seed = []() {
+        std::random_device random_device;
+        return ((unsigned long long) random_device() << 32) ^ random_device();
+    }();
+    char buffer[0x40];
+    std::snprintf(buffer, sizeof(buffer), "%llx%lx", seed, counter++);
+    return buffer;
+}
+
+/**
+ * Returns the address of the symbol in the module, or null if the module 
+ * does not define it.
+ */
+static void *cxx_module_symbol(CSOUND *csound, void *module_handle, const char *name) {
+    return csound->GetLibrarySymbol(module_handle, name);
+}
+
+typedef CxxInvokable *(*cxx_invokable_factory_t)();
+
+/**
+ * A preallocated arena of `CxxInvokable` instances, described by a 
+ * `CxxInvokablePool` that the module defines for the factory. All instances 
+ * are constructed when the pool is created. Free instances are kept on a 
+ * lock-free stack of slot indexes, whose head carries a tag to defeat the 
+ * ABA problem, so that notes can take and return instances on any thread 
+ * without allocating or locking.
+ */
+class CxxInstancePool {
+public:
+    CxxInstancePool(const CxxInvokablePool *description_) : description(description_) {
+        auto alignment = std::max(description->alignment, alignof(std::max_align_t));
+        stride = (description->size + alignment - 1) / alignment * alignment;
+        capacity = description->capacity;
+        arena = static_cast<char *>(aligned_allocate(alignment, stride * capacity));
+        if (arena == nullptr) {
+            capacity = 0;
+        }
+        next.reset(new std::atomic<uint32_t>[capacity + 1]);
+        instances.reset(new CxxInvokable *[capacity]);
+        for (size_t i = 0; i < capacity; ++i) {
+            instances[i] = description->construct(arena + i * stride);
+            push(i + 1);
+        }
+    }
+    ~CxxInstancePool() {
+        for (size_t i = 0; i < capacity; ++i) {
+            description->destroy(instances[i]);
+        }
+        aligned_free(arena);
+    }
+    /**
+     * Returns a free instance, or null if all instances are in use.
+     */
+    CxxInvokable *acquire() {
+        auto head_ = head.load(std::memory_order_acquire);
+        while (true) {
+            uint32_t index = head_ & 0xffffffff;
+            if (index == 0) {
+                return nullptr;
+            }
+            uint64_t new_head = ((head_ >> 32) + 1) << 32 | next[index].load(std::memory_order_relaxed);
+            if (head.compare_exchange_weak(head_, new_head, std::memory_order_acq_rel, std::memory_order_acquire)) {
+                return instances[index - 1];
+            }
+        }
+    }
+    /**
+     * Resets the instance and returns it to the pool. Returns false if the 
+     * instance does not belong to the pool.
+     */
+    bool release(CxxInvokable *invokable) {
+        auto address = reinterpret_cast<char *>(invokable);
+        if (capacity == 0 || address < arena || address >= arena + stride * capacity) {
+            return false;
+        }
+        description->reset(invokable);
+        push((address - arena) / stride + 1);
+        return true;
+    }
+    size_t size() const {
+        return capacity;
+    }
+private:
+    void push(uint32_t index) {
+        auto head_ = head.load(std::memory_order_relaxed);
+        while (true) {
+            next[index].store(head_ & 0xffffffff, std::memory_order_relaxed);
+            uint64_t new_head = ((head_ >> 32) + 1) << 32 | index;
+            if (head.compare_exchange_weak(head_, new_head, std::memory_order_release, std::memory_order_relaxed)) {
+                return;
+            }
+        }
+    }
+    static void *aligned_allocate(size_t alignment, size_t size) {
+#if defined(WIN32)
+        return _aligned_malloc(size, alignment);
+#else
+        void *memory = nullptr;
+        if (posix_memalign(&memory, alignment, size) != 0) {
+            return nullptr;
+        }
+        return memory;
+#endif
+    }
+    static void aligned_free(void *memory) {
+#if defined(WIN32)
+        _aligned_free(memory);
+#else
+        std::free(memory);
+#endif
+    }
+    const CxxInvokablePool *description;
+    size_t stride;
+    size_t capacity;
+    char *arena;
+    std::unique_ptr<CxxInvokable *[]> instances;
+    // Slot indexes are 1-based, so that 0 can mean the end of the stack.
+    std::unique_ptr<std::atomic<uint32_t>[]> next;
+    // The low 32 bits are the index of the first free slot, the high 32 bits 
+    // are incremented with every change.
+    std::atomic<uint64_t> head{0};
+};
+
+/**
+ * Returns true if `CXX_OPCODES_PROFILE` is set to anything other than "0" or 
+ * "off", in which case `cxx_invoke` times every call into each factory. The 
+ * setting is read only once, so that when profiling is off, the cost is one 
+ * predictable branch per call.
+ */
+static bool cxx_profile_enabled() {
+    static const bool enabled = []() {
+        auto value = std::getenv("CXX_OPCODES_PROFILE");
+        if (value == nullptr) {
+            return false;
+        }
+        std::string setting = value;
+        return !(setting.empty() || setting == "0" || setting == "off" || setting == "OFF");
+    }();
+    return enabled;
+}
+
+/**
+ * If `CXX_OPCODES_PROFILE` is set to a filepath rather than to "1" or "on", 
+ * returns that filepath, to which the JSON profile is written at exit.
+ */
+static std::string cxx_profile_filepath() {
+    auto value = std::getenv("CXX_OPCODES_PROFILE");
+    if (cxx_profile_enabled() == false) {
+        return "";
+    }
+    std::string setting = value;
+    if (setting == "1" || setting == "on" || setting == "ON") {
+        return "";
+    }
+    return setting;
+}
+
+/**
+ * Returns the time of a monotonic clock in nanoseconds.
+ */
+static uint64_t cxx_nanoseconds() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Returns the string as a quoted JSON string.
+ */
+static std::string json_string(const std::string &value) {
+    std::string result = "\"";
+    for (auto c : value) {
+        if (c == '"' || c == '\\') {
+            result.push_back('\\');
+            result.push_back(c);
+        } else if ((unsigned char) c < 0x20) {
+            char buffer[8];
+            std::snprintf(buffer, sizeof(buffer), "\\u%04x", (unsigned char) c);
+            result.append(buffer);
+        } else {
+            result.push_back(c);
+        }
+    }
+    result.push_back('"');
+    return result;
+}
+
+/**
+ * Timing statistics for the calls that `cxx_invoke` makes into the 
+ * instances of one factory. Durations are kept in histograms with one 
+ * bucket per power of 2 nanoseconds, so percentiles are upper bounds that 
+ * are accurate to within a factor of 2. Recording does not lock.
+ */
+class CxxProfile {
+public:
+    enum {
+        INIT = 0,
+        KONTROL,
+        NOTEOFF,
+        PHASES
+    };
+    static const char *phase_name(int phase) {
+        static const char *names[PHASES] = {"init", "kontrol", "noteoff"};
+        return names[phase];
+    }
+    void record(int phase, uint64_t nanoseconds) {
+        auto &statistics = phases[phase];
+        statistics.calls.fetch_add(1, std::memory_order_relaxed);
+        statistics.total.fetch_add(nanoseconds, std::memory_order_relaxed);
+        auto maximum = statistics.maximum.load(std::memory_order_relaxed);
+        while (nanoseconds > maximum && statistics.maximum.compare_exchange_weak(maximum, nanoseconds, std::memory_order_relaxed) == false) {
+        }
+        size_t bucket = 0;
+        while (bucket < 64 && (nanoseconds >> bucket) != 0) {
+            ++bucket;
+        }
+        statistics.histogram[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+    uint64_t calls(int phase) const {
+        return phases[phase].calls.load(std::memory_order_relaxed);
+    }
+    uint64_t total(int phase) const {
+        return phases[phase].total.load(std::memory_order_relaxed);
+    }
+    uint64_t maximum(int phase) const {
+        return phases[phase].maximum.load(std::memory_order_relaxed);
+    }
+    uint64_t mean(int phase) const {
+        auto calls_ = calls(phase);
+        return calls_ == 0 ? 0 : total(phase) / calls_;
+    }
+    /**
+     * Returns the upper bound of the histogram bucket that contains the 
+     * given fraction of calls, e.g. 0.99 for p99.
+     */
+    uint64_t percentile(int phase, double fraction) const {
+        auto &statistics = phases[phase];
+        auto calls_ = calls(phase);
+        if (calls_ == 0) {
+            return 0;
+        }
+        auto rank = (uint64_t) std::ceil(fraction * calls_);
+        uint64_t count = 0;
+        for (size_t bucket = 0; bucket < 65; ++bucket) {
+            count += statistics.histogram[bucket].load(std::memory_order_relaxed);
+            if (count >= rank) {
+                uint64_t bound = bucket == 0 ? 0 : bucket >= 64 ? UINT64_MAX : (uint64_t(1) << bucket) - 1;
+                return std::min(bound, maximum(phase));
+            }
+        }
+        return maximum(phase);
+    }
+private:
+    struct Statistics {
+        std::atomic<uint64_t> calls{0};
+        std::atomic<uint64_t> total{0};
+        std::atomic<uint64_t> maximum{0};
+        // Bucket b counts durations of less than 2^b nanoseconds.
+        std::atomic<uint64_t> histogram[65] = {};
+    };
+    Statistics phases[PHASES];
+};
+
+/**
+ * Owns the `CxxVoiceBank` that a module defines for a factory, and makes 
+ * sure that `process_voices` is called only once per kperiod, by the first 
+ * voice to be performed. The other voices of the kperiod see that the bank 
+ * has been processed with one atomic load. Voices are added, removed, and 
+ * processed under a spin lock, which never makes a system call and is 
+ * only contended with `--num-threads`, when notes that share the bank may 
+ * run concurrently; then a note that arrives while the bank is being 
+ * processed spins until its outputs have been computed.
+ */
+class CxxVoiceBankHost {
+public:
+    CxxVoiceBankHost(CxxVoiceBank *bank_) : bank(bank_) {}
+    ~CxxVoiceBankHost() {
+        delete bank;
+    }
+    int add_voice(CSOUND *csound, OPDS *opds, MYFLT **outputs, MYFLT **inputs) {
+        SpinLock lock(busy);
+        return bank->add_voice(csound, opds, outputs, inputs);
+    }
+    void remove_voice(CSOUND *csound, int voice) {
+        SpinLock lock(busy);
+        bank->remove_voice(csound, voice);
+    }
+    /**
+     * Processes all voices, unless that has already been done in this 
+     * kperiod.
+     */
+    int process(CSOUND *csound) {
+        auto kcounter = csound->GetKcounter(csound);
+        if (processed_kcounter.load(std::memory_order_acquire) == kcounter) {
+            return OK;
+        }
+        SpinLock lock(busy);
+        if (processed_kcounter.load(std::memory_order_relaxed) == kcounter) {
+            return OK;
+        }
+        auto result = bank->process_voices(csound);
+        processed_kcounter.store(kcounter, std::memory_order_release);
+        return result;
+    }
+private:
+    struct SpinLock {
+        SpinLock(std::atomic_flag &flag_) : flag(flag_) {
+            while (flag.test_and_set(std::memory_order_acquire)) {
+            }
+        }
+        ~SpinLock() {
+            flag.clear(std::memory_order_release);
+        }
+        std::atomic_flag &flag;
+    };
+    CxxVoiceBank *bank;
+    std::atomic_flag busy = ATOMIC_FLAG_INIT;
+    std::atomic<int64_t> processed_kcounter{-1};
+};
+
+/**
+ * A `CxxInvokable` factory function found in a loaded module, with the 
+ * instance pool or voice bank for the factory if the module defines one. 
+ * A factory that has a voice bank need not define the factory function.
+ *
+ * When `cxx_reload` replaces the module, the factory gets a successor, 
+ * which is used by new notes. When the module is replaced or unloaded, the 
+ * factory is retired. The factory counts the instances and voices that it 
+ * has created and that are still running, so that the module of a retired 
+ * factory can be unloaded once none are left.
+ */
+struct CxxFactory {
+    std::string name;
+    void *module_handle;
+    cxx_invokable_factory_t create;
+    CxxInstancePool *pool;
+    CxxVoiceBankHost *voice_bank;
+    CxxProfile *profile;
+    // True if the module declares that instances from this factory take 
+    // over running notes from the factory that it replaces.
+    bool migrates = false;
+    // The number of running instances and voices, or'ed with `RETIRED` 
+    // once the factory has been retired, so that a note can give up its 
+    // reference and learn whether the factory was retired in one atomic 
+    // operation, after which the factory may be deleted by another thread.
+    mutable std::atomic<int> references{0};
+    std::atomic<const CxxFactory *> successor{nullptr};
+    enum {
+        RETIRED = 1 << 30
+    };
+    void acquire() const {
+        references.fetch_add(1);
+    }
+    /**
+     * Returns true if this was the last running instance or voice of a 
+     * factory that has been retired. Must be the last access to the factory.
+     */
+    bool unacquire() const {
+        return references.fetch_sub(1) == (RETIRED | 1);
+    }
+    void retire() {
+        references.fetch_or(RETIRED);
+    }
+    bool retired() const {
+        return (references.load() & RETIRED) != 0;
+    }
+    /**
+     * Returns true if the factory has been retired and has no running 
+     * instances or voices.
+     */
+    bool unused() const {
+        return references.load() == RETIRED;
+    }
+    ~CxxFactory() {
+        delete pool;
+        delete voice_bank;
+        delete profile;
+    }
+    /**
+     * Returns an instance from the pool, or a new instance.
+     */
+    CxxInvokable *instantiate() const {
+        if (pool != nullptr) {
+            auto invokable = pool->acquire();
+            if (invokable != nullptr) {
+                return invokable;
+            }
+        }
+        return create();
+    }
+    /**
+     * Returns the instance to the pool, or deletes it.
+     */
+    void release(CxxInvokable *invokable) const {
+        if (pool != nullptr && pool->release(invokable)) {
+            return;
+        }
+        delete invokable;
+    }
+};
+
+/**
+ * Maps factory names to the factories defined in loaded modules, so that 
+ * `cxx_invoke` does not have to search all modules for every note.
+ *
+ * Lookups do not lock. The map is an immutable snapshot that is replaced 
+ * atomically by writers, who are serialized by the mutex. Replaced 
+ * snapshots and the factories of unloaded modules are retired rather than 
+ * deleted, because a concurrent reader may still be using them. Readers 
+ * hold a `Reader` while they look up a factory and until they have 
+ * acquired it, and retired objects are deleted only when there are no 
+ * readers, or by `clear`, when no opcodes are running.
+ *
+ * A factory is added the first time it is looked up, by searching the 
+ * loaded modules in the order in which they were loaded. If more than one 
+ * module defines the same factory name, the first module wins, and a 
+ * warning is printed.
+ */
+class CxxFactoryRegistry {
+public:
+    /**
+     * The registry searches the loaded modules of its Csound instance, and 
+     * is changed only with the mutex of that instance held.
+     */
+    CxxFactoryRegistry(std::mutex &mutex_, std::vector<void *> &loaded_modules_, const std::atomic<bool> &diagnostics_enabled_) : mutex(mutex_), loaded_modules(loaded_modules_), diagnostics_enabled(diagnostics_enabled_) {}
+    ~CxxFactoryRegistry() {
+        clear();
+    }
+    class Reader {
+    public:
+        Reader(CxxFactoryRegistry &registry_) : registry(registry_) {
+            registry.readers.fetch_add(1);
+        }
+        ~Reader() {
+            registry.readers.fetch_sub(1);
+        }
+    private:
+        CxxFactoryRegistry &registry;
+    };
+    /**
+     * Returns the factory with this name, or null if it has not been 
+     * registered. Never blocks.
+     */
+    const CxxFactory *find(const char *name) const {
+        auto snapshot = current.load();
+        if (snapshot == nullptr) {
+            return nullptr;
+        }
+        auto it = snapshot->find(std::string_view(name));
+        if (it == snapshot->end()) {
+            return nullptr;
+        }
+        return it->second;
+    }
+    /**
+     * Returns the factory with this name, searching the loaded modules for 
+     * it if it has not yet been registered. Returns null if no loaded module 
+     * defines it.
+     *
+     * The mutex is held only to copy the list of modules and to publish the 
+     * new factory. The modules are searched, and the factory and its pool 
+     * are created, without it, so that neither other notes nor compilations 
+     * wait for that. Meanwhile `collect` unloads no module. If the modules 
+     * have changed when the factory is to be published, the search is 
+     * repeated; if another note has published the factory first, that 
+     * factory is returned.
+     */
+    const CxxFactory *resolve(CSOUND *csound, const char *name) {
+        while (true) {
+            auto factory = find(name);
+            if (factory != nullptr) {
+                return factory;
+            }
+            std::vector<void *> modules;
+            uint64_t searched_changes;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                modules = loaded_modules;
+                searched_changes = changes;
+                resolving.fetch_add(1);
+            }
+            auto new_factory = search(csound, name, modules);
+            bool published = false;
+            bool retry = false;
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                factory = find(name);
+                if (new_factory != nullptr && factory == nullptr && searched_changes == changes) {
+                    factories.push_back(new_factory);
+                    auto snapshot = copy();
+                    snapshot->emplace(std::string_view(new_factory->name), new_factory);
+                    publish(snapshot);
+                    factory = new_factory;
+                    published = true;
+                }
+                retry = factory == nullptr && searched_changes != changes;
+            }
+            if (published == false) {
+                delete new_factory;
+            }
+            resolving.fetch_sub(1);
+            if (retry == false) {
+                return factory;
+            }
+        }
+    }
+    /**
+     * Returns true, once, if `collect` has been deferred because a factory 
+     * was being resolved, in which case the caller should collect again.
+     */
+    bool collect_deferred() {
+        return deferred_collection.exchange(false);
+    }
+    /**
+     * Called with the mutex held after `cxx_reload` has loaded a 
+     * module, to replace every registered factory that the module defines 
+     * with a factory from that module. Notes that are already running keep 
+     * the replaced factory. Returns the number of factories replaced.
+     */
+    int module_reloaded(CSOUND *csound, void *module_handle) {
+        changes++;
+        auto snapshot = copy();
+        std::vector<CxxFactory *> new_factories;
+        for (auto &entry : *snapshot) {
+            auto factory = const_cast<CxxFactory *>(entry.second);
+            auto create = (cxx_invokable_factory_t) cxx_module_symbol(csound, module_handle, factory->name.c_str());
+            auto voice_bank_name = factory->name + "_voice_bank";
+            auto voice_bank_function = (CxxVoiceBank *(*)()) cxx_module_symbol(csound, module_handle, voice_bank_name.c_str());
+            if (create == nullptr && voice_bank_function == nullptr) {
+                continue;
+            }
+            auto new_factory = make_factory(csound, factory->name.c_str(), module_handle, create, voice_bank_function);
+            factories.push_back(new_factory);
+            new_factories.push_back(new_factory);
+            factory->successor.store(new_factory);
+            retire(factory);
+            if (diagnostics_enabled) csound->Message(csound, "####### cxx_reload: replaced factory:        \"%s\" in module %p by module %p\n", factory->name.c_str(), factory->module_handle, module_handle);
+        }
+        // The keys view the names of the factories, so the entries are 
+        // replaced, not updated.
+        for (auto new_factory : new_factories) {
+            snapshot->erase(std::string_view(new_factory->name));
+            snapshot->emplace(std::string_view(new_factory->name), new_factory);
+        }
+        publish(snapshot);
+        return (int) new_factories.size();
+    }
+    /**
+     * Returns the modules that have been replaced by `cxx_reload` or 
+     * unloaded by `cxx_unload`, and that can now be unloaded because none 
+     * of their factories is current or has running instances or voices. 
+     * The pools and voice banks of their factories are deleted, since these 
+     * hold code from the modules. Called with the mutex held.
+     */
+    std::vector<void *> collect(CSOUND *csound) {
+        std::vector<void *> unloaded;
+        if (resolving.load() != 0) {
+            deferred_collection.store(true);
+            return unloaded;
+        }
+        for (auto it = retired_modules.begin(); it != retired_modules.end(); ) {
+            auto module_handle = *it;
+            bool in_use = false;
+            for (auto factory : factories) {
+                if (factory->module_handle == module_handle && factory->unused() == false) {
+                    in_use = true;
+                    break;
+                }
+            }
+            if (in_use) {
+                ++it;
+                continue;
+            }
+            for (auto factory : factories) {
+                if (factory->module_handle == module_handle) {
+                    delete factory->pool;
+                    factory->pool = nullptr;
+                    delete factory->voice_bank;
+                    factory->voice_bank = nullptr;
+                    factory->create = nullptr;
+                }
+            }
+            auto &modules = loaded_modules;
+            modules.erase(std::remove(modules.begin(), modules.end(), module_handle), modules.end());
+            changes++;
+            if (diagnostics_enabled) csound->Message(csound, "####### cxx_unload: unloading module:          %p\n", module_handle);
+            unloaded.push_back(module_handle);
+            it = retired_modules.erase(it);
+        }
+        return unloaded;
+    }
+    /**
+     * Deletes the replaced snapshots, and the factories of modules that 
+     * have been unloaded, if no reader can be using them. Called with 
+     * the mutex held. Returns true if they were deleted.
+     */
+    bool reclaim() {
+        if (readers.load() != 0) {
+            return false;
+        }
+        auto snapshot = current.load();
+        for (auto it = snapshots.begin(); it != snapshots.end(); ) {
+            if (*it != snapshot) {
+                delete *it;
+                it = snapshots.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        auto &modules = loaded_modules;
+        for (auto it = factories.begin(); it != factories.end(); ) {
+            auto factory = *it;
+            if (factory->unused() && std::find(modules.begin(), modules.end(), factory->module_handle) == modules.end() && std::find(retired_modules.begin(), retired_modules.end(), factory->module_handle) == retired_modules.end()) {
+                delete factory;
+                it = factories.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        return true;
+    }
+    /**
+     * Called with the mutex held after a module has been loaded, to 
+     * warn about factories that the module defines but that are already 
+     * registered from another module.
+     */
+    void module_loaded(CSOUND *csound, void *module_handle) {
+        changes++;
+        auto snapshot = current.load(std::memory_order_acquire);
+        if (snapshot == nullptr) {
+            return;
+        }
+        for (const auto &entry : *snapshot) {
+            auto factory = entry.second;
+            if (factory->module_handle == module_handle) {
+                continue;
+            }
+            if (cxx_module_symbol(csound, module_handle, factory->name.c_str()) != nullptr) {
+                csound->Message(csound, "WARNING: cxx_invoke: factory \"%s\" in module %p is hidden by the same factory in module %p.\n", factory->name.c_str(), module_handle, factory->module_handle);
+            }
+        }
+    }
+    /**
+     * Called with the mutex held when a module is to be unloaded, to 
+     * unregister and retire all factories in that module. The module is 
+     * unloaded by `collect` once their last notes have ended.
+     */
+    void module_unloaded(void *module_handle) {
+        changes++;
+        auto snapshot = copy();
+        for (auto it = snapshot->begin(); it != snapshot->end(); ) {
+            if (it->second->module_handle == module_handle) {
+                it = snapshot->erase(it);
+            } else {
+                ++it;
+            }
+        }
+        publish(snapshot);
+        for (auto factory : factories) {
+            if (factory->module_handle == module_handle) {
+                retire(factory);
+            }
+        }
+        if (std::find(retired_modules.begin(), retired_modules.end(), module_handle) == retired_modules.end()) {
+            retired_modules.push_back(module_handle);
+        }
+    }
+    /**
+     * Returns all factories that have been registered.
+     */
+    std::vector<const CxxFactory *> registered() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return std::vector<const CxxFactory *>(factories.begin(), factories.end());
+    }
+    /**
+     * Deletes all factories and snapshots. Must only be called when no 
+     * opcodes are running.
+     */
+    void clear() {
+        std::lock_guard<std::mutex> lock(mutex);
+        current.store(nullptr, std::memory_order_release);
+        for (auto snapshot : snapshots) {
+            delete snapshot;
+        }
+        snapshots.clear();
+        for (auto factory : factories) {
+            delete factory;
+        }
+        factories.clear();
+        retired_modules.clear();
+    }
+private:
+    /**
+     * Searches the modules, in order, for the factory function or voice 
+     * bank with this name, and creates the factory for the first module 
+     * that defines either. Returns null if none does.
+     */
+    CxxFactory *search(CSOUND *csound, const char *name, const std::vector<void *> &modules) {
+        CxxFactory *new_factory = nullptr;
+        for (auto module_handle : modules) {
+            if (diagnostics_enabled) csound->Message(csound, "####### cxx_invoke::init: library handle:          %p\n", module_handle);
+            auto create = (cxx_invokable_factory_t) cxx_module_symbol(csound, module_handle, name);
+            auto voice_bank_name = std::string(name) + "_voice_bank";
+            auto voice_bank_function = (CxxVoiceBank *(*)()) cxx_module_symbol(csound, module_handle, voice_bank_name.c_str());
+            if (create == nullptr && voice_bank_function == nullptr) {
+                continue;
+            }
+            if (new_factory == nullptr) {
+                new_factory = make_factory(csound, name, module_handle, create, voice_bank_function);
+            } else {
+                csound->Message(csound, "WARNING: cxx_invoke: factory \"%s\" in module %p is hidden by the same factory in module %p.\n", name, module_handle, new_factory->module_handle);
+            }
+        }
+        return new_factory;
+    }
+    void retire(CxxFactory *factory) {
+        factory->retire();
+        if (std::find(retired_modules.begin(), retired_modules.end(), factory->module_handle) == retired_modules.end()) {
+            retired_modules.push_back(factory->module_handle);
+        }
+    }
+    /**
+     * Creates the factory for the symbols found in the module, with its 
+     * pool if the module defines one, and whether it migrates running 
+     * notes.
+     */
+    CxxFactory *make_factory(CSOUND *csound, const char *name, void *module_handle, cxx_invokable_factory_t create, CxxVoiceBank *(*voice_bank_function)()) {
+        auto new_factory = new CxxFactory{name, module_handle, create, nullptr, nullptr, nullptr};
+        if (cxx_profile_enabled()) {
+            new_factory->profile = new CxxProfile();
+        }
+        auto pool_name = std::string(name) + "_pool";
+        auto pool_function = (const CxxInvokablePool *(*)()) cxx_module_symbol(csound, module_handle, pool_name.c_str());
+        if (pool_function != nullptr) {
+            new_factory->pool = new CxxInstancePool(pool_function());
+            if (diagnostics_enabled) csound->Message(csound, "####### cxx_invoke::init: created pool of %d for:  \"%s\"\n", (int) new_factory->pool->size(), name);
+        }
+        auto migrates_name = std::string(name) + "_migrates";
+        auto migrates_function = (int (*)()) cxx_module_symbol(csound, module_handle, migrates_name.c_str());
+        if (migrates_function != nullptr) {
+            new_factory->migrates = migrates_function() != 0;
+        }
+        if (voice_bank_function != nullptr) {
+            new_factory->voice_bank = new CxxVoiceBankHost(voice_bank_function());
+            if (diagnostics_enabled) csound->Message(csound, "####### cxx_invoke::init: created voice bank for:  \"%s\"\n", name);
+        }
+        return new_factory;
+    }
+    typedef std::unordered_map<std::string_view, const CxxFactory *> Snapshot;
+    Snapshot *copy() const {
+        auto snapshot = current.load();
+        if (snapshot == nullptr) {
+            return new Snapshot();
+        }
+        return new Snapshot(*snapshot);
+    }
+    void publish(Snapshot *snapshot) {
+        snapshots.push_back(snapshot);
+        current.store(snapshot);
+    }
+    std::atomic<const Snapshot *> current{nullptr};
+    std::vector<Snapshot *> snapshots;
+    std::vector<CxxFactory *> factories;
+    std::vector<void *> retired_modules;
+    std::atomic<int> readers{0};
+    // The number of notes that are searching the modules for a factory.
+    std::atomic<int> resolving{0};
+    std::atomic<bool> deferred_collection{false};
+    // Incremented, with the mutex held, whenever the loaded modules change.
+    uint64_t changes = 0;
+    std::mutex &mutex;
+    std::vector<void *> &loaded_modules;
+    const std::atomic<bool> &diagnostics_enabled;
+};
+
+/**
+ * Caches the factory that each `cxx_invoke` opcode in the orchestra has 
+ * resolved, keyed by the opcode's text (`OPDS::optext`), which is shared by 
+ * all instances of that opcode in all instances of its instrument. Once an 
+ * opcode has been resolved, later notes find their factory with a pointer 
+ * comparison and a string comparison, without hashing the factory name.
+ *
+ * A binding is valid only for the module generation in which it was made, 
+ * so bindings are revalidated whenever the set of loaded modules changes. 
+ * The factory name is compared as well, because it may come from a string 
+ * variable that differs from note to note.
+ *
+ * The table is a fixed-size, open-addressed array of atomic pointers to 
+ * immutable bindings, and neither lookups nor updates lock. Replaced 
+ * bindings are pushed onto a lock-free retired list, and are deleted only 
+ * by `clear`.
+ */
+class CxxBindingCache {
+public:
+    ~CxxBindingCache() {
+        clear();
+    }
+    const CxxFactory *find(const void *optext, const char *name, uint64_t generation) const {
+        auto start = slot_index(optext);
+        for (size_t probe = 0; probe < PROBES; ++probe) {
+            auto binding = slots[(start + probe) & (SLOTS - 1)].load(std::memory_order_acquire);
+            if (binding == nullptr) {
+                return nullptr;
+            }
+            if (binding->optext == optext) {
+                if (binding->generation == generation && binding->factory->name == name) {
+                    return binding->factory;
+                }
+                return nullptr;
+            }
+        }
+        return nullptr;
+    }
+    /**
+     * Binds the opcode text to the factory for this generation. If the table 
+     * is too full, the binding is simply not cached.
+     */
+    void bind(const void *optext, uint64_t generation, const CxxFactory *factory) {
+        auto binding = new Binding{optext, generation, factory, nullptr};
+        auto start = slot_index(optext);
+        for (size_t probe = 0; probe < PROBES; ++probe) {
+            auto &slot = slots[(start + probe) & (SLOTS - 1)];
+            auto existing = slot.load(std::memory_order_acquire);
+            while (existing == nullptr || existing->optext == optext) {
+                if (slot.compare_exchange_weak(existing, binding, std::memory_order_acq_rel)) {
+                    if (existing != nullptr) {
+                        retire(const_cast<Binding *>(existing));
+                    }
+                    return;
+                }
+            }
+        }
+        retire(binding);
+    }
+    /**
+     * Deletes the bindings that have been replaced. Must only be called when 
+     * no lookups are in progress.
+     */
+    void reclaim() {
+        auto binding = retired.exchange(nullptr);
+        while (binding != nullptr) {
+            auto next = binding->next_retired;
+            delete binding;
+            binding = next;
+        }
+    }
+    /**
+     * Deletes all bindings. Must only be called when no opcodes are running.
+     */
+    void clear() {
+        for (auto &slot : slots) {
+            auto binding = slot.exchange(nullptr);
+            delete binding;
+        }
+        auto binding = retired.exchange(nullptr);
+        while (binding != nullptr) {
+            auto next = binding->next_retired;
+            delete binding;
+            binding = next;
+        }
+    }
+private:
+    struct Binding {
+        const void *optext;
+        uint64_t generation;
+        const CxxFactory *factory;
+        Binding *next_retired;
+    };
+    enum {
+        SLOTS = 4096,
+        PROBES = 16,
+    };
+    static size_t slot_index(const void *optext) {
+        auto value = reinterpret_cast<uintptr_t>(optext);
+        return (size_t) (((value >> 4) * 0x9e3779b97f4a7c15ULL) >> 52);
+    }
+    void retire(Binding *binding) {
+        auto head = retired.load(std::memory_order_relaxed);
+        do {
+            binding->next_retired = head;
+        } while (retired.compare_exchange_weak(head, binding, std::memory_order_release, std::memory_order_relaxed) == false);
+    }
+    std::atomic<const Binding *> slots[SLOTS] = {};
+    std::atomic<Binding *> retired{nullptr};
+};
+
+/**
+ * Returns the profiles of all factories in the registry, either as text or as 
+ * JSON. The budget of a factory is the fraction of the audio time, i.e. of 
+ * all kperiods so far, that was spent in its `kontrol` calls.
+ */
+static std::string cxx_profile_report(CSOUND *csound, const CxxFactoryRegistry &factory_registry, bool json) {
+    double kperiod_nanoseconds = csound->GetKsmps(csound) / csound->GetSr(csound) * 1.0e9;
+    auto kperiods = csound->GetKcounter(csound);
+    std::string report;
+    char buffer[0x200];
+    if (json) {
+        std::snprintf(buffer, sizeof(buffer), "{\"kperiod_ns\": %.0f, \"kperiods\": %lld, \"factories\": [", kperiod_nanoseconds, (long long) kperiods);
+    } else {
+        std::snprintf(buffer, sizeof(buffer), "cxx_profile: kperiod: %.0f ns kperiods: %lld\n", kperiod_nanoseconds, (long long) kperiods);
+    }
+    report.append(buffer);
+    bool first = true;
+    for (auto factory : factory_registry.registered()) {
+        auto profile = factory->profile;
+        if (profile == nullptr) {
+            continue;
+        }
+        double budget = kperiods > 0 ? profile->total(CxxProfile::KONTROL) / (kperiods * kperiod_nanoseconds) : 0;
+        if (json) {
+            std::snprintf(buffer, sizeof(buffer), "%s{\"name\": %s, \"budget\": %.6f", first ? "" : ", ", json_string(factory->name).c_str(), budget);
+        } else {
+            std::snprintf(buffer, sizeof(buffer), "cxx_profile: factory: \"%s\" budget: %.3f%%\n", factory->name.c_str(), budget * 100.0);
+        }
+        report.append(buffer);
+        for (int phase = 0; phase < CxxProfile::PHASES; ++phase) {
+            if (json) {
+                std::snprintf(buffer, sizeof(buffer), ", \"%s\": {\"calls\": %llu, \"total_ns\": %llu, \"mean_ns\": %llu, \"p99_ns\": %llu, \"max_ns\": %llu}",
+                    CxxProfile::phase_name(phase), 
+                    (unsigned long long) profile->calls(phase), 
+                    (unsigned long long) profile->total(phase), 
+                    (unsigned long long) profile->mean(phase), 
+                    (unsigned long long) profile->percentile(phase, 0.99), 
+                    (unsigned long long) profile->maximum(phase));
+            } else {
+                std::snprintf(buffer, sizeof(buffer), "cxx_profile:     %-8s calls: %10llu total: %14llu ns mean: %10llu ns p99: %10llu ns max: %10llu ns\n",
+                    CxxProfile::phase_name(phase), 
+                    (unsigned long long) profile->calls(phase), 
+                    (unsigned long long) profile->total(phase), 
+                    (unsigned long long) profile->mean(phase), 
+                    (unsigned long long) profile->percentile(phase, 0.99), 
+                    (unsigned long long) profile->maximum(phase));
+            }
+            report.append(buffer);
+        }
+        if (json) {
+            report.append("}");
+        }
+        first = false;
+    }
+    if (json) {
+        report.append("]}\n");
+    }
+    return report;
+}
+
+/**
+ * Writes the JSON profile to the file, returning true on success.
+ */
+static bool cxx_profile_write(CSOUND *csound, const CxxFactoryRegistry &factory_registry, const std::string &filepath) {
+    auto file_ = std::fopen(filepath.c_str(), "w");
+    if (file_ == nullptr) {
+        return false;
+    }
+    auto report = cxx_profile_report(csound, factory_registry, true);
+    std::fwrite(report.data(), 1, report.size(), file_);
+    std::fclose(file_);
+    return true;
+}
+
+/**
+ * The `cxx_compile` opcode will call a uniquely named function that must be 
+ * defined in the module. The type of this function must be
+ * `extern "C" int (*)(CSOUND *csound)`. This function serves as the entry 
+ * point to the module, similar to 'main' in a C or C++ program.
+ *
+ * When the entry point is called, `csoundStart` has _already_ been called,
+ * and Csound is performing an init pass, which for `cxx_compile` used in the
+ * orchestra header will be the first init pass in the orchestra header
+ * (that is, "instr 0").
+ */
+extern "C" {
+    typedef int (*csound_main_t)(CSOUND *csound);
+};
+
+/**
+ * Guards the few things that all Csound instances in this process share: the 
+ * lists of temporary and memory files, and the telemetry log. It is never 
+ * held while a Csound instance performs.
+ */
+static std::mutex &get_mutex() {
+    static std::mutex mutex_;
+    return mutex_;
+}
+
+/**
+ * The compile cache stores compiled modules on disk, keyed by a hash of 
+ * everything that can change the module: the source code, the normalized 
+ * compiler command, the compiler version, and the Csound headers found in 
+ * the include directories of the compiler command. On a cache hit, 
+ * `cxx_compile` loads the cached module and does not run the toolchain.
+ *
+ * The cache is configured with environment variables:
+ *
+ * - `CXX_OPCODES_CACHE` - "0" or "off" bypasses the cache; "clear" clears 
+ *   it before first use in this process. Otherwise the cache is enabled.
+ * - `CXX_OPCODES_CACHE_DIR` - The cache directory; the default is 
+ *   `csound-cxx-cache` in the system temporary directory.
+ * - `CXX_OPCODES_CACHE_SIZE_MB` - The size limit of the cache in megabytes;
+ *   the default is 1024. When the limit is exceeded, least recently used 
+ *   entries are evicted.
+ *
+ * Several Csound processes may share one cache. New entries are first 
+ * written to a unique temporary file and then atomically renamed into place, 
+ * and loading and eviction are serialized with an advisory file lock.
+ */
+static uint64_t fnv1a_64(const void *data, size_t size, uint64_t hash = 0xcbf29ce484222325ULL) {
+    auto bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static uint64_t fnv1a_64(const std::string &data, uint64_t hash = 0xcbf29ce484222325ULL) {
+    return fnv1a_64(data.data(), data.size(), hash);
+}
+
+static std::string read_file(const std::filesystem::path &filepath) {
+    std::string contents;
+    auto file_ = std::fopen(filepath.string().c_str(), "rb");
+    if (file_ == nullptr) {
+        return contents;
+    }
+    char buffer[0x4000];
+    size_t count;
+    while ((count = std::fread(buffer, 1, sizeof(buffer), file_)) > 0) {
+        contents.append(buffer, count);
+    }
+    std::fclose(file_);
+    return contents;
+}
+
+static bool cxx_cache_enabled() {
+    auto value = std::getenv("CXX_OPCODES_CACHE");
+    if (value == nullptr) {
+        return true;
+    }
+    std::string setting = value;
+    return !(setting == "0" || setting == "off" || setting == "OFF");
+}
+
+/**
+ * Returns true if `CXX_OPCODES_TELEMETRY` is set to anything other than "0" 
+ * or "off", or if `CXX_OPCODES_TELEMETRY_LOG` is set. Then the duration of 
+ * each phase of each compilation is reported, and compiling and linking are 
+ * run as separate steps so that they can be timed separately.
+ */
+static bool cxx_telemetry_enabled() {
+    auto value = std::getenv("CXX_OPCODES_TELEMETRY");
+    if (value != nullptr) {
+        std::string setting = value;
+        if (!(setting.empty() || setting == "0" || setting == "off" || setting == "OFF")) {
+            return true;
+        }
+    }
+    auto log_filepath = std::getenv("CXX_OPCODES_TELEMETRY_LOG");
+    return log_filepath != nullptr && std::strlen(log_filepath) > 0;
+}
+
+/**
+ * Returns true if `CXX_OPCODES_TIME_TRACE` is set to anything other than 
+ * "0" or "off". Then `-ftime-trace` is passed to the compiler (which must be 
+ * clang), and the trace is kept next to the module.
+ */
+static bool cxx_time_trace_enabled() {
+    auto value = std::getenv("CXX_OPCODES_TIME_TRACE");
+    if (value == nullptr) {
+        return false;
+    }
+    std::string setting = value;
+    return !(setting.empty() || setting == "0" || setting == "off" || setting == "OFF");
+}
+
+/**
+ * Returns true if modules that are not cached are compiled without touching 
+ * the filesystem: the source code is streamed to the compiler on stdin, and 
+ * the compiler writes the module to an anonymous memory file, which is 
+ * loaded through `/proc/self/fd`. Only on Linux, and not when a time trace 
+ * is wanted. `CXX_OPCODES_MEMFD` set to "0" or "off" disables this.
+ */
+static bool cxx_memfd_enabled() {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    auto value = std::getenv("CXX_OPCODES_MEMFD");
+    if (value != nullptr) {
+        std::string setting = value;
+        if (setting == "0" || setting == "off" || setting == "OFF") {
+            return false;
+        }
+    }
+    return cxx_time_trace_enabled() == false;
+#else
+    return false;
+#endif
+}
+
+/**
+ * Returns an anonymous memory file, and in `filepath` a path by which child 
+ * processes can write to it. Returns -1 if the file could not be created.
+ */
+static int cxx_memfd_create(const char *name, std::string &filepath) {
+#if defined(__linux__) && defined(MFD_CLOEXEC)
+    int fd = memfd_create(name, MFD_CLOEXEC);
+    if (fd >= 0) {
+        filepath = "/proc/" + std::to_string(getpid()) + "/fd/" + std::to_string(fd);
+    }
+    return fd;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * Returns the compile timeout in seconds, from `CXX_OPCODES_COMPILE_TIMEOUT`; 
+ * by default 300 seconds. 0 means no timeout.
+ */
+static double cxx_compile_timeout() {
+    auto value = std::getenv("CXX_OPCODES_COMPILE_TIMEOUT");
+    if (value == nullptr || std::strlen(value) == 0) {
+        return 300.;
+    }
+    return std::max(0., std::atof(value));
+}
+
+/**
+ * Runs a program directly, without a shell. The first argument is the 
+ * program, which is found on the PATH. If `input` is not null, it is 
+ * written to the program's stdin. Everything the program writes to stdout 
+ * and stderr is collected in `output`. If the program runs longer than the 
+ * timeout, it and its children are killed and `timed_out` is set. Returns 
+ * the exit status of the program, 128 plus the signal number if it was 
+ * killed by a signal, or 127 if it could not be started.
+ *
+ * On Windows, the program is run by the command interpreter, its output is 
+ * collected through a temporary file, and the timeout is not enforced.
+ */
+static int cxx_run(const std::vector<std::string> &arguments, const std::string *input, double timeout, std::string &output, bool &timed_out) {
+    timed_out = false;
+    if (arguments.empty()) {
+        return 127;
+    }
+#if defined(WIN32)
+    std::string command;
+    for (const auto &argument : arguments) {
+        command.append(argument.find(' ') == std::string::npos ? argument : "\"" + argument + "\"");
+        command.push_back(' ');
+    }
+    std::error_code error_code;
+    auto output_filepath = std::filesystem::temp_directory_path(error_code) / ("cxx_run_" + unique_suffix() + ".txt");
+    command.append("> \"" + output_filepath.string() + "\" 2>&1");
+    int status = 127;
+    if (input == nullptr) {
+        status = std::system(command.c_str());
+    } else {
+        auto pipe_ = _popen(command.c_str(), "wb");
+        if (pipe_ != nullptr) {
+            std::fwrite(input->data(), 1, input->size(), pipe_);
+            status = _pclose(pipe_);
+        }
+    }
+    auto file_ = std::fopen(output_filepath.string().c_str(), "rb");
+    if (file_ != nullptr) {
+        char buffer[0x1000];
+        size_t count;
+        while ((count = std::fread(buffer, 1, sizeof(buffer), file_)) > 0) {
+            output.append(buffer, count);
+        }
+        std::fclose(file_);
+    }
+    std::filesystem::remove(output_filepath, error_code);
+    return status;
+#else
+    int input_pipe[2] = {-1, -1};
+    int output_pipe[2] = {-1, -1};
+    if ((input != nullptr && pipe(input_pipe) != 0) || pipe(output_pipe) != 0) {
+        output.append("could not create pipes: " + std::string(std::strerror(errno)) + "\n");
+        return 127;
+    }
+    for (auto fd : {input_pipe[0], input_pipe[1], output_pipe[0], output_pipe[1]}) {
+        if (fd >= 0) {
+            fcntl(fd, F_SETFD, FD_CLOEXEC);
+        }
+    }
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    if (input != nullptr) {
+        posix_spawn_file_actions_adddup2(&actions, input_pipe[0], STDIN_FILENO);
+    } else {
+        posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+    }
+    posix_spawn_file_actions_adddup2(&actions, output_pipe[1], STDOUT_FILENO);
+    posix_spawn_file_actions_adddup2(&actions, output_pipe[1], STDERR_FILENO);
+    // The program runs in its own process group, so that a timeout also 
+    // kills the compiler's own children.
+    posix_spawnattr_t attributes;
+    posix_spawnattr_init(&attributes);
+    posix_spawnattr_setflags(&attributes, POSIX_SPAWN_SETPGROUP);
+    posix_spawnattr_setpgroup(&attributes, 0);
+    std::vector<char *> argv;
+    for (const auto &argument : arguments) {
+        argv.push_back(const_cast<char *>(argument.c_str()));
+    }
+    argv.push_back(nullptr);
+    pid_t pid = -1;
+    auto spawn_result = posix_spawnp(&pid, argv[0], &actions, &attributes, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attributes);
+    if (input_pipe[0] >= 0) {
+        close(input_pipe[0]);
+    }
+    close(output_pipe[1]);
+    if (spawn_result != 0) {
+        if (input_pipe[1] >= 0) {
+            close(input_pipe[1]);
+        }
+        close(output_pipe[0]);
+        output.append("could not run " + arguments[0] + ": " + std::strerror(spawn_result) + "\n");
+        return 127;
+    }
+    // Writing to a program that has already exited must not raise SIGPIPE 
+    // in Csound.
+    sigset_t sigpipe_set;
+    sigset_t old_set;
+    sigemptyset(&sigpipe_set);
+    sigaddset(&sigpipe_set, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &sigpipe_set, &old_set);
+    int input_fd = input_pipe[1];
+    int output_fd = output_pipe[0];
+    size_t input_offset = 0;
+    if (input_fd >= 0) {
+        fcntl(input_fd, F_SETFL, fcntl(input_fd, F_GETFL) | O_NONBLOCK);
+        if (input->empty()) {
+            close(input_fd);
+            input_fd = -1;
+        }
+    }
+    fcntl(output_fd, F_SETFL, fcntl(output_fd, F_GETFL) | O_NONBLOCK);
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeout);
+    while (output_fd >= 0) {
+        int wait_ms = -1;
+        if (timeout > 0) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now()).count();
+            if (remaining <= 0) {
+                timed_out = true;
+                break;
+            }
+            wait_ms = (int) std::min<long long>(remaining, 1000);
+        }
+        pollfd fds[2];
+        nfds_t fd_count = 0;
+        fds[fd_count++] = {output_fd, POLLIN, 0};
+        if (input_fd >= 0) {
+            fds[fd_count++] = {input_fd, POLLOUT, 0};
+        }
+        if (poll(fds, fd_count, wait_ms) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if (fds[0].revents != 0) {
+            char buffer[0x1000];
+            auto count = read(output_fd, buffer, sizeof(buffer));
+            if (count > 0) {
+                output.append(buffer, count);
+            } else if (count == 0 || (errno != EAGAIN && errno != EINTR)) {
+                close(output_fd);
+                output_fd = -1;
+            }
+        }
+        if (input_fd >= 0 && fd_count > 1 && fds[1].revents != 0) {
+            auto count = write(input_fd, input->data() + input_offset, input->size() - input_offset);
+            if (count > 0) {
+                input_offset += count;
+            }
+            if ((count < 0 && errno != EAGAIN && errno != EINTR) || input_offset == input->size()) {
+                close(input_fd);
+                input_fd = -1;
+            }
+        }
+    }
+    if (input_fd >= 0) {
+        close(input_fd);
+    }
+    if (output_fd >= 0) {
+        close(output_fd);
+    }
+    if (timed_out) {
+        kill(-pid, SIGKILL);
+        kill(pid, SIGKILL);
+    }
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR) {
+    }
+    // Discard any SIGPIPE raised while the mask was in effect.
+    sigset_t pending;
+    sigpending(&pending);
+    if (sigismember(&pending, SIGPIPE)) {
+        int signal_number;
+        sigwait(&sigpipe_set, &signal_number);
+    }
+    pthread_sigmask(SIG_SETMASK, &old_set, nullptr);
+    if (WIFEXITED(status)) {
+        return WEXITSTATUS(status);
+    }
+    if (WIFSIGNALED(status)) {
+        return 128 + WTERMSIG(status);
+    }
+    return 127;
+#endif
+}
+
+/**
+ * Files written outside the compile cache, which are removed when the 
+ * opcodes are destroyed. Guarded by `get_mutex()`.
+ */
+static std::vector<std::string> &temporary_files() {
+    static std::vector<std::string> temporary_files_;
+    return temporary_files_;
+}
+
+/**
+ * The memory files of loaded modules, by module handle. Guarded by 
+ * `get_mutex()`.
+ */
+static std::map<void *, int> &memory_files() {
+    static std::map<void *, int> memory_files_;
+    return memory_files_;
+}
+
+static void cxx_remove_temporary_files() {
+    std::lock_guard<std::mutex> lock(get_mutex());
+    std::error_code error_code;
+    for (const auto &filepath : temporary_files()) {
+        std::filesystem::remove(filepath, error_code);
+    }
+    temporary_files().clear();
+#if !defined(WIN32)
+    for (const auto &entry : memory_files()) {
+        close(entry.second);
+    }
+#endif
+    memory_files().clear();
+}
+
+static std::filesystem::path cxx_cache_directory() {
+    std::filesystem::path directory;
+    auto value = std::getenv("CXX_OPCODES_CACHE_DIR");
+    if (value != nullptr && std::strlen(value) > 0) {
+        directory = value;
+    } else {
+        directory = std::filesystem::temp_directory_path() / "csound-cxx-cache";
+    }
+    std::error_code error_code;
+    std::filesystem::create_directories(directory, error_code);
+    return directory;
+}
+
+static uintmax_t cxx_cache_size_limit() {
+    uintmax_t megabytes = 1024;
+    auto value = std::getenv("CXX_OPCODES_CACHE_SIZE_MB");
+    if (value != nullptr) {
+        megabytes = std::strtoull(value, nullptr, 10);
+    }
+    return megabytes * 1024 * 1024;
+}
+
+/**
+ * Advisory lock on the cache directory, shared for loading entries and 
+ * exclusive for evicting them. This serializes eviction against loading 
+ * across all Csound processes that use the same cache directory.
+ */
+class CxxCacheLock {
+public:
+    CxxCacheLock(const std::filesystem::path &directory, bool exclusive) {
+#if (defined(__linux__) || defined(__unix__) || defined(__APPLE__))
+        auto lock_filepath = directory / ".lock";
+        fd = open(lock_filepath.c_str(), O_RDWR | O_CREAT, 0666);
+        if (fd != -1) {
+            flock(fd, exclusive ? LOCK_EX : LOCK_SH);
+        }
+#endif
+    }
+    ~CxxCacheLock() {
+#if (defined(__linux__) || defined(__unix__) || defined(__APPLE__))
+        if (fd != -1) {
+            flock(fd, LOCK_UN);
+            close(fd);
+        }
+#endif
+    }
+private:
+    int fd = -1;
+};
+
+/**
+ * Returns the output of `compiler --version`, which is run only once per 
+ * compiler per process.
+ */
+static std::string compiler_version(const std::string &compiler) {
+    static std::mutex mutex_;
+    static std::map<std::string, std::string> versions;
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = versions.find(compiler);
+    if (it != versions.end()) {
+        return it->second;
+    }
+    std::string version;
+    bool timed_out = false;
+    cxx_run({compiler, "--version"}, nullptr, 60., version, timed_out);
+    versions[compiler] = version;
+    return version;
+}
+
+/**
+ * Splits a compiler command on all whitespace, which may include newlines 
+ * in multi-line string literals. Single and double quotes and backslashes 
+ * work as in the shell, since the compiler is run without one.
+ */
+static std::vector<std::string> command_tokens(const std::string &command) {
+    std::vector<std::string> tokens;
+    std::string token;
+    bool in_token = false;
+    char quote = 0;
+    for (size_t i = 0; i < command.size(); ++i) {
+        auto c = command[i];
+        if (quote != 0) {
+            if (c == quote) {
+                quote = 0;
+            } else if (c == '\\' && quote == '"' && i + 1 < command.size() && (command[i + 1] == '"' || command[i + 1] == '\\')) {
+                token.push_back(command[++i]);
+            } else {
+                token.push_back(c);
+            }
+        } else if (std::isspace(static_cast<unsigned char>(c))) {
+            if (in_token) {
+                tokens.push_back(token);
+                token.clear();
+                in_token = false;
+            }
+        } else if (c == '"' || c == '\'') {
+            quote = c;
+            in_token = true;
+        } else if (c == '\\' && i + 1 < command.size()) {
+            token.push_back(command[++i]);
+            in_token = true;
+        } else {
+            token.push_back(c);
+            in_token = true;
+        }
+    }
+    if (in_token) {
+        tokens.push_back(token);
+    }
+    return tokens;
+}
+
+/**
+ * Hashes the Csound and cxx headers that the compiler command can see, so 
+ * that upgrading Csound or these opcodes invalidates cached modules.
+ */
+static uint64_t csound_headers_hash(const std::vector<std::string> &tokens, uint64_t hash) {
+    static const char *header_names[] = {
+        "csdl.h",
+        "csound.h",
+        "csoundCore.h",
+        "float-version.h",
+        "version.h",
+        "OpcodeBase.hpp",
+        "cxx_invokable.hpp",
+    };
+    std::vector<std::string> include_directories;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (tokens[i] == "-I" && i + 1 < tokens.size()) {
+            include_directories.push_back(tokens[i + 1]);
+        } else if (tokens[i].rfind("-I", 0) == 0 && tokens[i].size() > 2) {
+            include_directories.push_back(tokens[i].substr(2));
+        }
+    }
+    for (const auto &include_directory : include_directories) {
+        for (auto header_name : header_names) {
+            auto header_filepath = std::filesystem::path(include_directory) / header_name;
+            std::error_code error_code;
+            if (std::filesystem::is_regular_file(header_filepath, error_code)) {
+                hash = fnv1a_64(header_filepath.string(), hash);
+                hash = fnv1a_64(read_file(header_filepath), hash);
+            }
+        }
+    }
+    return hash;
+}
+
+/**
+ * Returns the cache key for the module that would be compiled from this 
+ * source code with this compiler command. The `-v` option is ignored 
+ * because it does not change the compiled module.
+ */
+static std::string cxx_cache_key(const std::string &source_code, const std::string &compiler_command) {
+    auto tokens = command_tokens(compiler_command);
+    std::string normalized_command;
+    for (const auto &token : tokens) {
+        if (token == "-v") {
+            continue;
+        }
+        normalized_command.append(token);
+        normalized_command.push_back(' ');
+    }
+    uint64_t hash = fnv1a_64(source_code);
+    hash = fnv1a_64(normalized_command, hash);
+    if (!tokens.empty()) {
+        hash = fnv1a_64(compiler_version(tokens[0]), hash);
+    }
+    hash = csound_headers_hash(tokens, hash);
+    char key[0x20];
+    std::snprintf(key, sizeof(key), "%016llx", (unsigned long long) hash);
+    return key;
+}
+
+/**
+ * Removes least recently used modules from the cache until the total size 
+ * of the cache is within its limit.
+ */
+static void cxx_cache_evict(const std::filesystem::path &directory) {
+    CxxCacheLock lock(directory, true);
+    struct Entry {
+        std::filesystem::path path;
+        std::filesystem::file_time_type time;
+        uintmax_t size;
+    };
+    std::vector<Entry> entries;
+    uintmax_t total_size = 0;
+    std::error_code error_code;
+    auto now = std::filesystem::file_time_type::clock::now();
+    for (const auto &directory_entry : std::filesystem::directory_iterator(directory, error_code)) {
+        auto extension = directory_entry.path().extension();
+        if (!directory_entry.is_regular_file(error_code)) {
+            continue;
+        }
+        // Files that are written before they are renamed into the cache, 
+        // i.e. `<key>-<suffix>.cpp` and `*.tmp`, are left behind only by a 
+        // process that crashed while compiling; they are removed once they 
+        // are old enough that no compilation can still be using them.
+        bool staged = extension == ".tmp" || (extension == ".cpp" && directory_entry.path().stem().string().find('-') != std::string::npos);
+        if (staged) {
+            if (now - directory_entry.last_write_time(error_code) > std::chrono::hours(1)) {
+                std::filesystem::remove(directory_entry.path(), error_code);
+            }
+            continue;
+        }
+        if (extension != ".so") {
+            continue;
+        }
+        Entry entry{directory_entry.path(), directory_entry.last_write_time(error_code), directory_entry.file_size(error_code)};
+        total_size += entry.size;
+        entries.push_back(entry);
+    }
+    auto size_limit = cxx_cache_size_limit();
+    if (total_size <= size_limit) {
+        return;
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry &a, const Entry &b) {
+        return a.time < b.time;
+    });
+    for (const auto &entry : entries) {
+        if (total_size <= size_limit) {
+            break;
+        }
+        auto source_filepath = entry.path;
+        source_filepath.replace_extension(".cpp");
+        auto time_trace_filepath = entry.path;
+        time_trace_filepath.replace_extension(".time-trace.json");
+        std::filesystem::remove(entry.path, error_code);
+        std::filesystem::remove(source_filepath, error_code);
+        std::filesystem::remove(time_trace_filepath, error_code);
+        total_size -= entry.size;
+    }
+}
+
+/**
+ * Removes every entry from the cache.
+ */
+static void cxx_cache_clear(const std::filesystem::path &directory) {
+    CxxCacheLock lock(directory, true);
+    std::error_code error_code;
+    for (const auto &directory_entry : std::filesystem::directory_iterator(directory, error_code)) {
+        if (directory_entry.path().filename() == ".lock") {
+            continue;
+        }
+        std::filesystem::remove_all(directory_entry.path(), error_code);
+    }
+}
+
+/**
+ * Returns the cache directory, first clearing the cache if the environment 
+ * asks for that.
+ */
+static std::filesystem::path cxx_cache_prepare() {
+    static std::once_flag once;
+    auto directory = cxx_cache_directory();
+    std::call_once(once, [&directory]() {
+        auto value = std::getenv("CXX_OPCODES_CACHE");
+        if (value != nullptr && std::string(value) == "clear") {
+            cxx_cache_clear(directory);
+        }
+    });
+    return directory;
+}
+
+/**
+ * Everything needed to compile and load one module, and the outcome. The 
+ * toolchain and the dynamic loader may run on any thread, so diagnostics 
+ * are collected in a log that is written to Csound's message stream by 
+ * the opcode that owns the compilation.
+ */
+struct CxxCompilation {
+    // INPUTS
+    std::string entry_point;
+    std::string source_code;
+    std::string compiler_command;
+    std::string dynamic_link_libraries;
+    std::string prelude_headers;
+    bool diagnostics_enabled = false;
+    // The orchestra line of the opcode that requested the compilation.
+    int orchestra_line = 0;
+    // Set by `cxx_reload`, whose module replaces the factories it defines.
+    bool reload = false;
+    // OUTPUTS
+    int result = 0;
+    bool cache_hit = false;
+    std::string module_filepath;
+    void *module_handle = nullptr;
+    std::string log;
+    // TELEMETRY
+    struct Phase {
+        std::string name;
+        std::string detail;
+        double milliseconds;
+    };
+    std::vector<Phase> phases;
+    std::string time_trace_filepath;
+    /**
+     * Records a phase that began at `start`, and returns the time at which 
+     * it ended.
+     */
+    uint64_t record_phase(const char *name, uint64_t start, const std::string &detail = "") {
+        auto end = cxx_nanoseconds();
+        phases.push_back({name, detail, (end - start) / 1.0e6});
+        return end;
+    }
+    void message(const char *format, ...) {
+        char buffer[0x2000];
+        va_list args;
+        va_start(args, format);
+        std::vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        log.append(buffer);
+    }
+    void flush_log(CSOUND *csound) {
+        if (log.empty() == false) {
+            csound->Message(csound, "%s", log.c_str());
+            log.clear();
+        }
+    }
+};
+
+/**
+ * Returns the arguments as one command line, for messages.
+ */
+static std::string command_line(const std::vector<std::string> &arguments) {
+    std::string line;
+    for (const auto &argument : arguments) {
+        if (line.empty() == false) {
+            line.push_back(' ');
+        }
+        line.append(argument);
+    }
+    return line;
+}
+
+/**
+ * Returns the source code of the compilation preceded by a `#line` directive, 
+ * so that the compiler reports the lines of the source code as lines of the 
+ * orchestra, counted from the line of the opcode that requested the 
+ * compilation. The directive is not part of the cache key, so moving the 
+ * opcode in the orchestra does not cause a recompilation.
+ */
+static std::string cxx_line_directed_source(const CxxCompilation &compilation) {
+    char directive[0x100];
+    std::snprintf(directive, sizeof(directive), "#line %d \"orchestra\"\n", std::max(compilation.orchestra_line, 1));
+    return directive + compilation.source_code;
+}
+
+/**
+ * Runs the compiler, without a shell, with the arguments, writing the 
+ * source code to its stdin if `source_filepath` is "-". The compiler's 
+ * output is added to the log of the compilation, preceded by the entry 
+ * point and the orchestra line of the opcode. Returns the exit status of 
+ * the compiler.
+ */
+static int cxx_run_compiler(CxxCompilation &compilation, const std::vector<std::string> &arguments, const std::string &source_filepath) {
+    if (compilation.diagnostics_enabled) {    
+        compilation.message("####### cxx_compile: command:            %s\n", command_line(arguments).c_str());
+    }
+    std::string output;
+    bool timed_out = false;
+    auto timeout = cxx_compile_timeout();
+    std::string input;
+    if (source_filepath == "-") {
+        input = cxx_line_directed_source(compilation);
+    }
+    auto result = cxx_run(arguments, source_filepath == "-" ? &input : nullptr, timeout, output, timed_out);
+    if (output.empty() == false) {
+        if (source_filepath.empty() == false) {
+            compilation.message("cxx_compile: diagnostics for %s, compiled at orchestra line %d:\n", compilation.entry_point.c_str(), compilation.orchestra_line);
+        }
+        if (output.back() != '\n') {
+            output.push_back('\n');
+        }
+        compilation.log.append(output);
+    }
+    if (timed_out) {
+        compilation.message("Error: cxx_compile: %s was stopped after %g seconds, see CXX_OPCODES_COMPILE_TIMEOUT.\n", arguments[0].c_str(), timeout);
+    }
+    return result;
+}
+
+/**
+ * A header that includes the prelude headers shared by many modules, with 
+ * its precompiled form. There is one prelude for each distinct combination 
+ * of compiler, compiler flags, and prelude headers, in its own directory in 
+ * the compile cache. The prelude is included in each module that requests 
+ * it, using the precompiled header if it is current.
+ */
+struct CxxPrelude {
+    std::filesystem::path header_filepath;
+    std::filesystem::path pch_filepath;
+    std::filesystem::path dependencies_filepath;
+    // The compiler command without the options that only apply to linking.
+    std::string compile_command;
+    std::vector<std::string> compile_arguments;
+    bool clang = false;
+};
+
+/**
+ * Returns the C++ text of the prelude header, which has one `#include` 
+ * for each name in the space-separated list of prelude headers. Names in 
+ * quotes or angle brackets are included as they are, other names in angle 
+ * brackets.
+ */
+static std::string prelude_text(const std::string &prelude_headers) {
+    std::string text = "// Prelude headers for cxx_compile.\n";
+    for (const auto &header : command_tokens(prelude_headers)) {
+        if (header.empty()) {
+            continue;
+        }
+        if (header.front() == '<' || header.front() == '"') {
+            text += "#include " + header + "\n";
+        } else {
+            text += "#include <" + header + ">\n";
+        }
+    }
+    return text;
+}
+
+/**
+ * Returns the tokens of the compiler command without `-v` and without the 
+ * options and inputs that only apply to linking.
+ */
+static std::vector<std::string> compile_options(const std::vector<std::string> &tokens) {
+    std::vector<std::string> options;
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        const auto &token = tokens[i];
+        if (token == "-o") {
+            ++i;
+            continue;
+        }
+        auto extension = std::filesystem::path(token).extension().string();
+        if (token == "-v" || token == "-shared" || token == "-rdynamic" || token.rfind("-l", 0) == 0 || token.rfind("-L", 0) == 0 || token.rfind("-Wl,", 0) == 0 || (token.empty() == false && token.front() != '-' && (extension == ".so" || extension == ".a" || extension == ".o" || extension == ".dylib"))) {
+            continue;
+        }
+        options.push_back(token);
+    }
+    return options;
+}
+
+/**
+ * Returns the prelude for this compiler command and these prelude headers. 
+ * Nothing is written or built.
+ */
+static CxxPrelude cxx_prelude(const std::string &compiler_command, const std::string &prelude_headers) {
+    CxxPrelude prelude;
+    auto tokens = command_tokens(compiler_command);
+    std::string compile_command;
+    for (const auto &option : compile_options(tokens)) {
+        compile_command.append(option);
+        compile_command.push_back(' ');
+    }
+    auto version = tokens.empty() ? std::string() : compiler_version(tokens[0]);
+    prelude.clang = version.find("clang") != std::string::npos;
+    uint64_t hash = fnv1a_64(prelude_text(prelude_headers));
+    hash = fnv1a_64(compile_command, hash);
+    hash = fnv1a_64(version, hash);
+    hash = csound_headers_hash(tokens, hash);
+    char key[0x20];
+    std::snprintf(key, sizeof(key), "%016llx", (unsigned long long) hash);
+    auto directory = cxx_cache_directory() / (std::string("prelude-") + key);
+    prelude.header_filepath = directory / "prelude.hpp";
+    prelude.pch_filepath = directory / (prelude.clang ? "prelude.hpp.pch" : "prelude.hpp.gch");
+    prelude.dependencies_filepath = directory / "prelude.hpp.d";
+    prelude.compile_command = compile_command;
+    prelude.compile_arguments = compile_options(tokens);
+    return prelude;
+}
+
+/**
+ * Returns true if the precompiled header exists and is newer than every 
+ * header that it includes, as listed in the dependency file that the 
+ * compiler wrote when it was built.
+ */
+static bool cxx_prelude_is_current(const CxxPrelude &prelude) {
+    std::error_code error_code;
+    auto pch_time = std::filesystem::last_write_time(prelude.pch_filepath, error_code);
+    if (error_code) {
+        return false;
+    }
+    auto dependencies = read_file(prelude.dependencies_filepath);
+    if (dependencies.empty()) {
+        return false;
+    }
+    // The dependency file has the form "target: header header \\\n header ...", 
+    // with spaces in filepaths escaped by backslashes.
+    auto colon = dependencies.find(": ");
+    std::string dependency;
+    for (size_t i = colon == std::string::npos ? 0 : colon + 2; i <= dependencies.size(); ++i) {
+        char c = i < dependencies.size() ? dependencies[i] : '\n';
+        if (c == '\\' && i + 1 < dependencies.size() && dependencies[i + 1] == ' ') {
+            dependency.push_back(' ');
+            ++i;
+        } else if (c == '\\' || std::isspace(static_cast<unsigned char>(c))) {
+            if (dependency.empty() == false) {
+                auto dependency_time = std::filesystem::last_write_time(dependency, error_code);
+                if (error_code || dependency_time > pch_time) {
+                    return false;
+                }
+                dependency.clear();
+            }
+        } else {
+            dependency.push_back(c);
+        }
+    }
+    return true;
+}
+
+/**
+ * Writes the prelude header unless it already exists. Returns false if it 
+ * could not be written.
+ */
+static bool cxx_write_prelude_header(const CxxPrelude &prelude, CxxCompilation &compilation) {
+    std::error_code error_code;
+    std::filesystem::create_directories(prelude.header_filepath.parent_path(), error_code);
+    if (std::filesystem::is_regular_file(prelude.header_filepath, error_code) == false) {
+        auto temporary_filepath = prelude.header_filepath.string() + "." + unique_suffix();
+        auto file_ = std::fopen(temporary_filepath.c_str(), "w");
+        if (file_ == nullptr) {
+            compilation.message("WARNING: cxx_compile: could not write the prelude header %s.\n", prelude.header_filepath.string().c_str());
+            return false;
+        }
+        auto text = prelude_text(compilation.prelude_headers);
+        std::fwrite(text.data(), 1, text.size(), file_);
+        std::fclose(file_);
+        std::filesystem::rename(temporary_filepath, prelude.header_filepath, error_code);
+    }
+    return true;
+}
+
+/**
+ * Writes the prelude header and, unless it is current, builds the 
+ * precompiled header. Concurrent builds by other threads or processes are 
+ * safe, because each builds to its own temporary files, which are renamed 
+ * into place. Returns the arguments that make a module include the 
+ * prelude: with gcc, `-include` finds the `.gch` file next to the header; 
+ * with clang, `-include-pch` names the precompiled header. If the 
+ * precompiled header could not be built, the prelude header itself is 
+ * included. The filepaths are single arguments, so they may contain spaces.
+ */
+static std::vector<std::string> cxx_build_prelude(CxxPrelude &prelude, CxxCompilation &compilation) {
+    auto time = cxx_nanoseconds();
+    std::error_code error_code;
+    std::vector<std::string> include_arguments{"-include", prelude.header_filepath.string()};
+    auto suffix = "." + unique_suffix();
+    if (cxx_write_prelude_header(prelude, compilation) == false) {
+        return {};
+    }
+    if (cxx_prelude_is_current(prelude) == false) {
+        auto pch_filepath = prelude.pch_filepath.string() + suffix;
+        auto dependencies_filepath = prelude.dependencies_filepath.string() + suffix;
+        auto arguments = prelude.compile_arguments;
+        arguments.insert(arguments.end(), {"-x", "c++-header", prelude.header_filepath.string(), "-MD", "-MF", dependencies_filepath, "-o", pch_filepath});
+        auto result = cxx_run_compiler(compilation, arguments, "");
+        if (result == 0) {
+            std::filesystem::rename(dependencies_filepath, prelude.dependencies_filepath, error_code);
+            std::filesystem::rename(pch_filepath, prelude.pch_filepath, error_code);
+        } else {
+            std::filesystem::remove(dependencies_filepath, error_code);
+            std::filesystem::remove(pch_filepath, error_code);
+            compilation.message("WARNING: cxx_compile: could not precompile the prelude headers, result: %d.\n", result);
+        }
+        compilation.record_phase("precompile_prelude", time);
+        if (result != 0) {
+            return include_arguments;
+        }
+    } else {
+        compilation.record_phase("prelude_lookup", time);
+    }
+    if (prelude.clang) {
+        return {"-include-pch", prelude.pch_filepath.string()};
+    }
+    if (compilation.diagnostics_enabled) {
+        include_arguments.push_back("-Winvalid-pch");
+    }
+    return include_arguments;
+}
+
+/**
+ * Preloads, in global scope, the dynamic link libraries required by the 
+ * module. Returns the time at which the last library was loaded.
+ */
+static uint64_t cxx_preload_libraries(CxxCompilation &compilation, uint64_t time) {
+    std::vector<std::string> dynamic_link_library_names;
+    tokenize(compilation.dynamic_link_libraries, ' ', dynamic_link_library_names);
+    for (const auto &dynamic_link_library_name : dynamic_link_library_names) {
+        auto library_result = cxx_load_library(dynamic_link_library_name.c_str());
+        time = compilation.record_phase("preload", time, dynamic_link_library_name);
+#if (defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)) 
+        if (library_result == nullptr) {
+                auto error_message = dlerror();
+                compilation.message("Error: dlerror: \"%s\" when trying to load %s\n", error_message, dynamic_link_library_name.c_str());
+        }
+#endif
+        if (compilation.diagnostics_enabled && library_result != nullptr) {
+            compilation.message("####### cxx_compile: loaded dependency:  %s\n", dynamic_link_library_name.c_str());
+        }
+    }
+    return time;
+}
+
+/**
+ * Compiles the module, or finds it in the compile cache, then preloads the 
+ * dynamic link libraries required by the module, then loads the module. 
+ * Does not use Csound, and may be called from any thread.
+ */
+static int cxx_build_module(CxxCompilation &compilation) {
+    auto &source_code = compilation.source_code;
+    char filepath[0x500] = "";
+    char module_filepath[0x600];
+    char output_filepath[0x600];
+    int result = 0;
+    auto time = cxx_nanoseconds();
+    // Modules that include a prelude are cached separately from modules 
+    // that do not, and for each distinct prelude.
+    CxxPrelude prelude;
+    std::string prelude_key;
+    if (compilation.prelude_headers.empty() == false) {
+        prelude = cxx_prelude(compilation.compiler_command, compilation.prelude_headers);
+        prelude_key = " -include " + prelude.header_filepath.string();
+    }
+    // Look up the module in the compile cache. The shared cache lock is 
+    // held until the module has been loaded, so that it cannot be evicted 
+    // in the meantime.
+    bool cache_enabled = cxx_cache_enabled();
+    bool cache_hit = false;
+    std::filesystem::path cache_directory;
+    std::unique_ptr<CxxCacheLock> cache_lock;
+    // Without the cache, the module may be written to an anonymous memory 
+    // file.
+    int module_fd = -1;
+    std::string memfd_filepath;
+    if (cache_enabled) {
+        cache_directory = cxx_cache_prepare();
+        auto cache_key = cxx_cache_key(source_code, compilation.compiler_command + prelude_key);
+        auto cached_filepath = cache_directory / (cache_key + ".so");
+        std::snprintf(module_filepath, 0x600, "%s", cached_filepath.string().c_str());
+        cache_lock.reset(new CxxCacheLock(cache_directory, false));
+        std::error_code error_code;
+        if (std::filesystem::is_regular_file(cached_filepath, error_code)) {
+            // Touching the module makes it the most recently used entry.
+            std::filesystem::last_write_time(cached_filepath, std::filesystem::file_time_type::clock::now(), error_code);
+            cache_hit = true;
+        } else {
+            cache_lock.reset();
+            auto unique_filepath = cache_directory / (cache_key + "-" + unique_suffix());
+            std::snprintf(filepath, 0x500, "%s.cpp", unique_filepath.string().c_str());
+            std::snprintf(output_filepath, 0x600, "%s.so.tmp", unique_filepath.string().c_str());
+        }
+        if (compilation.diagnostics_enabled) {    
+            compilation.message("####### cxx_compile: cache:              %s %s\n", cache_hit ? "hit " : "miss", module_filepath);
+        }
+    } else if (cxx_memfd_enabled() && (module_fd = cxx_memfd_create("cxx_module", memfd_filepath)) >= 0) {
+        std::snprintf(module_filepath, 0x600, "/proc/self/fd/%d", module_fd);
+        std::snprintf(output_filepath, 0x600, "%s", memfd_filepath.c_str());
+    } else {
+        std::snprintf(filepath, 0x500, "%s/cxx_opcode_%s.cpp", std::filesystem::temp_directory_path().string().c_str(), unique_suffix().c_str());
+        std::snprintf(module_filepath, 0x600, "%s.so", filepath);
+        std::snprintf(output_filepath, 0x600, "%s", module_filepath);
+        std::lock_guard lock(get_mutex());
+        temporary_files().push_back(filepath);
+        temporary_files().push_back(module_filepath);
+    }
+    compilation.cache_hit = cache_hit;
+    if (cache_enabled) {
+        time = compilation.record_phase("cache_lookup", time);
+    }
+    if (cache_hit == false) {
+        // Create a temporary file containing the source code, unless the 
+        // source code is streamed to the compiler.
+        if (module_fd < 0) {
+            std::lock_guard lock(get_mutex());
+            auto file_ = fopen(filepath, "w+");
+            auto line_directed_source = cxx_line_directed_source(compilation);
+            std::fwrite(line_directed_source.data(), line_directed_source.size(), sizeof(line_directed_source[0]), file_);
+            std::fclose(file_);
+            time = compilation.record_phase("write_source", time);
+        }
+        auto compile_arguments = command_tokens(compilation.compiler_command);
+        if (compilation.prelude_headers.empty() == false) {
+            auto prelude_arguments = cxx_build_prelude(prelude, compilation);
+            compile_arguments.insert(compile_arguments.end(), prelude_arguments.begin(), prelude_arguments.end());
+            time = cxx_nanoseconds();
+        }
+        // The source code is either in the file, or streamed to the 
+        // compiler on stdin.
+        std::vector<std::string> source_arguments{filepath};
+        std::string source_filepath = filepath;
+        if (module_fd >= 0) {
+            source_arguments = {"-x", "c++", "-"};
+            source_filepath = "-";
+        }
+        bool time_trace = cxx_time_trace_enabled();
+        if (cxx_telemetry_enabled() || time_trace) {
+            // Compile and link in separate steps, so that each can be timed. 
+            // `-x none` keeps a `-x c++` option in the compiler command from 
+            // applying to the object file.
+            std::string object_filepath = std::string(filepath) + ".o";
+            int object_fd = -1;
+            if (module_fd >= 0) {
+                object_fd = cxx_memfd_create("cxx_object", object_filepath);
+            }
+            auto arguments = compile_arguments;
+            if (time_trace) {
+                arguments.push_back("-ftime-trace");
+            }
+            arguments.push_back("-c");
+            arguments.insert(arguments.end(), source_arguments.begin(), source_arguments.end());
+            arguments.insert(arguments.end(), {"-o", object_filepath});
+            if (module_fd >= 0 && object_fd < 0) {
+                result = -1;
+            } else {
+                result = cxx_run_compiler(compilation, arguments, source_filepath);
+            }
+            time = compilation.record_phase("compile", time);
+            if (result == 0) {
+                arguments = command_tokens(compilation.compiler_command);
+                arguments.insert(arguments.end(), {"-x", "none", object_filepath, "-o", output_filepath});
+                result = cxx_run_compiler(compilation, arguments, "");
+                time = compilation.record_phase("link", time);
+            }
+            if (object_fd >= 0) {
+                close(object_fd);
+            } else {
+                std::error_code error_code;
+                std::filesystem::remove(object_filepath, error_code);
+            }
+            if (time_trace) {
+                // clang names the trace after the object file.
+                compilation.time_trace_filepath = std::filesystem::path(object_filepath).replace_extension(".json").string();
+            }
+        } else {
+            auto arguments = compile_arguments;
+            arguments.insert(arguments.end(), source_arguments.begin(), source_arguments.end());
+            arguments.insert(arguments.end(), {"-o", output_filepath});
+            result = cxx_run_compiler(compilation, arguments, source_filepath);
+            time = compilation.record_phase("compile_and_link", time);
+        }
+        if (compilation.diagnostics_enabled) {
+            compilation.message("####### cxx_compile: result:             %d\n", result);
+        }
+        // A failed compilation leaves nothing in the cache.
+        if (cache_enabled && result != 0) {
+            std::error_code error_code;
+            std::filesystem::remove(filepath, error_code);
+            std::filesystem::remove(output_filepath, error_code);
+        }
+        // Atomically publish the new module in the cache, together with 
+        // its source code. The shared cache lock is taken before the module 
+        // is published, and held until it has been loaded, so that the 
+        // module cannot be evicted in between.
+        if (cache_enabled && result == 0) {
+            cache_lock.reset(new CxxCacheLock(cache_directory, false));
+            std::error_code error_code;
+            auto cached_source_filepath = std::filesystem::path(module_filepath).replace_extension(".cpp");
+            std::filesystem::rename(output_filepath, module_filepath, error_code);
+            if (error_code) {
+                compilation.message("Error: cxx_compile: could not store %s in the compile cache: %s\n", module_filepath, error_code.message().c_str());
+                // The module is loaded from where it was built, and removed 
+                // with the other temporary files.
+                std::snprintf(module_filepath, 0x600, "%s", output_filepath);
+                std::filesystem::remove(filepath, error_code);
+                std::lock_guard lock(get_mutex());
+                temporary_files().push_back(output_filepath);
+            } else {
+                std::filesystem::rename(filepath, cached_source_filepath, error_code);
+            }
+        }
+        // Keep the time trace next to the module.
+        if (compilation.time_trace_filepath.empty() == false) {
+            std::error_code error_code;
+            auto time_trace_filepath = std::filesystem::path(module_filepath).replace_extension(".time-trace.json");
+            std::filesystem::rename(compilation.time_trace_filepath, time_trace_filepath, error_code);
+            if (error_code) {
+                compilation.message("WARNING: cxx_compile: no time trace was written to %s.\n", compilation.time_trace_filepath.c_str());
+                compilation.time_trace_filepath.clear();
+            } else {
+                compilation.time_trace_filepath = time_trace_filepath.string();
+            }
+        }
+        time = cxx_nanoseconds();
+    }
+    compilation.module_filepath = module_fd >= 0 ? "(in memory)" : module_filepath;
+    if (result != 0) {
+        if (module_fd >= 0) {
+            close(module_fd);
+        }
+        compilation.result = result;
+        return result;
+    }
+    // First, preload dynamic link libraries required by our compiled 
+    // module.
+    time = cxx_preload_libraries(compilation, time);
+    // Then, load our compiled module.
+    void *module_handle = nullptr;
+    ///result = csound->OpenLibrary(&module_handle, module_filepath);
+    module_handle = cxx_load_library(module_filepath);
+    time = compilation.record_phase("dlopen", time);
+#if (defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)) 
+    ///if (result != OK) {
+    if (module_handle == nullptr) {
+            auto error_message = dlerror();
+            compilation.message("Error: dlerror: %s\n", error_message);
+    }
+#endif
+    cache_lock.reset();
+    // The memory file of a loaded module is kept open, because the loader 
+    // identifies modules by their filepath, and a new memory file with the 
+    // same descriptor would otherwise be taken for the loaded module.
+    if (module_fd >= 0) {
+        std::lock_guard lock(get_mutex());
+        if (module_handle == nullptr) {
+            close(module_fd);
+        } else {
+            memory_files()[module_handle] = module_fd;
+        }
+    }
+    if (module_handle == nullptr) {
+        // A cached module that cannot be loaded is removed, so that 
+        // it will be compiled again next time.
+        if (cache_hit == true) {
+            std::error_code error_code;
+            std::filesystem::remove(module_filepath, error_code);
+        }
+        compilation.message("Error: cxx_compile: could not load %s\n", module_filepath);
+        compilation.result = NOTOK;
+        return NOTOK;
+    }
+    if (compilation.diagnostics_enabled) {
+        compilation.message("####### cxx_compile: loaded module:      %s handle: %p\n", module_filepath, module_handle);
+    }
+    compilation.module_handle = module_handle;
+    if (cache_enabled && cache_hit == false) {
+        cxx_cache_evict(cache_directory);
+        time = compilation.record_phase("cache_evict", time);
+    }
+    compilation.result = OK;
+    return OK;
+}
+
+/**
+ * A compilation submitted by `cxx_compile_async`. The status is written by 
+ * the compiler thread and read by `cxx_compile_status` without waiting.
+ */
+struct CxxCompileJob {
+    enum {
+        PENDING = 0,
+        READY = 1,
+        FAILED = -1,
+    };
+    CxxCompilation compilation;
+    std::atomic<int> build_status{PENDING};
+    // Set by the first `cxx_compile_status` that starts the module.
+    std::atomic<bool> claimed{false};
+    std::atomic<int> status{PENDING};
+};
+
+/**
+ * Runs compilations submitted by `cxx_compile_async` on a pool of 
+ * background threads, so that the toolchain never runs on a Csound thread, 
+ * and so that several modules can be compiled at the same time. The pool 
+ * has as many threads as the machine has cores, or as many as the 
+ * `CXX_OPCODES_COMPILE_THREADS` environment variable specifies. Threads are 
+ * started only as they are needed. Each Csound instance has its own queue, 
+ * whose jobs and handles the other instances do not see; jobs that have not 
+ * been started when the queue is deleted are abandoned.
+ */
+class CxxCompileQueue {
+public:
+    ~CxxCompileQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping = true;
+        }
+        condition.notify_all();
+        for (auto &worker : workers) {
+            if (worker.joinable()) {
+                worker.join();
+            }
+        }
+    }
+    /**
+     * Submits a job and returns its handle, which is always greater than 0.
+     */
+    int submit(std::shared_ptr<CxxCompileJob> job) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        jobs.push_back(job);
+        queue.push_back(job);
+        unstarted_jobs++;
+        if (idle_workers < queue.size() && workers.size() < thread_count()) {
+            workers.push_back(std::thread(&CxxCompileQueue::run, this));
+        }
+        condition.notify_one();
+        return (int) jobs.size();
+    }
+    std::shared_ptr<CxxCompileJob> job(int handle) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (handle < 1 || handle > (int) jobs.size()) {
+            return nullptr;
+        }
+        return jobs[handle - 1];
+    }
+    /**
+     * Waits until every job that has been submitted so far has been built, 
+     * then returns those jobs in the order in which they were submitted.
+     */
+    std::vector<std::shared_ptr<CxxCompileJob>> wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        auto submitted = jobs;
+        finished.wait(lock, [&submitted]() {
+            for (const auto &job : submitted) {
+                if (job->build_status == CxxCompileJob::PENDING) {
+                    return false;
+                }
+            }
+            return true;
+        });
+        return submitted;
+    }
+    /**
+     * Returns the number of jobs whose modules have not yet been started, 
+     * so that opcodes can tell a factory that is pending from one that does 
+     * not exist.
+     */
+    int unstarted() const {
+        return unstarted_jobs;
+    }
+    void started() {
+        unstarted_jobs--;
+    }
+private:
+    static size_t thread_count() {
+        size_t count = std::thread::hardware_concurrency();
+        auto value = std::getenv("CXX_OPCODES_COMPILE_THREADS");
+        if (value != nullptr && std::atoi(value) > 0) {
+            count = std::atoi(value);
+        }
+        return std::max(count, size_t(1));
+    }
+    void run() {
+        while (true) {
+            std::shared_ptr<CxxCompileJob> job;
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                idle_workers++;
+                condition.wait(lock, [this]() {
+                    return stopping || queue.empty() == false;
+                });
+                idle_workers--;
+                if (stopping) {
+                    return;
+                }
+                job = queue.front();
+                queue.pop_front();
+            }
+            auto result = cxx_build_module(job->compilation);
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                job->build_status = (result == OK) ? CxxCompileJob::READY : CxxCompileJob::FAILED;
+            }
+            finished.notify_all();
+        }
+    }
+    std::mutex mutex_;
+    std::condition_variable condition;
+    std::condition_variable finished;
+    std::deque<std::shared_ptr<CxxCompileJob>> queue;
+    std::vector<std::shared_ptr<CxxCompileJob>> jobs;
+    std::atomic<int> unstarted_jobs{0};
+    std::vector<std::thread> workers;
+    size_t idle_workers = 0;
+    bool stopping = false;
+};
+
+/**
+ * Returns the latency, in kperiods, of the instances that `cxx_invoke` 
+ * runs on the offload worker: 2, or the value of the 
+ * `CXX_OPCODES_OFFLOAD_LATENCY` environment variable.
+ */
+static size_t cxx_offload_latency() {
+    size_t latency = 2;
+    auto value = std::getenv("CXX_OPCODES_OFFLOAD_LATENCY");
+    if (value != nullptr && std::atoi(value) > 0) {
+        latency = std::atoi(value);
+    }
+    return latency;
+}
+
+/**
+ * A lock-free ring of blocks of samples of the same size, for one producer 
+ * thread and one consumer thread. Each block carries the sequence number of 
+ * the kperiod that it belongs to.
+ */
+class CxxBlockRing {
+public:
+    CxxBlockRing(size_t capacity_, size_t block_size_) : capacity(capacity_), block_size(block_size_), blocks(capacity_ * block_size_), sequences(capacity_) {}
+    /**
+     * Returns the block to be written next, or null if the ring is full. 
+     * Called by the producer.
+     */
+    MYFLT *back() {
+        auto tail_ = tail.load(std::memory_order_relaxed);
+        if (tail_ - head.load(std::memory_order_acquire) == capacity) {
+            return nullptr;
+        }
+        return blocks.data() + (tail_ % capacity) * block_size;
+    }
+    void push(uint64_t sequence) {
+        auto tail_ = tail.load(std::memory_order_relaxed);
+        sequences[tail_ % capacity] = sequence;
+        tail.store(tail_ + 1, std::memory_order_release);
+    }
+    /**
+     * Returns the block to be read next, and its sequence number, or null 
+     * if the ring is empty. Called by the consumer.
+     */
+    MYFLT *front(uint64_t &sequence) {
+        auto head_ = head.load(std::memory_order_relaxed);
+        if (tail.load(std::memory_order_acquire) == head_) {
+            return nullptr;
+        }
+        sequence = sequences[head_ % capacity];
+        return blocks.data() + (head_ % capacity) * block_size;
+    }
+    void pop() {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+private:
+    size_t capacity;
+    size_t block_size;
+    std::vector<MYFLT> blocks;
+    std::vector<uint64_t> sequences;
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+/**
+ * An instance that `cxx_invoke` runs with `i_thread` 4. Every kperiod, the 
+ * note copies the inputs of the instance into one ring, and copies the 
+ * outputs that the offload worker has computed from the inputs of `latency` 
+ * kperiods before out of another ring. Outputs that the worker has not 
+ * computed in time are silent, and are discarded when they arrive, so that 
+ * the latency never changes. Inputs that are neither a-rate nor scalars, 
+ * e.g. strings, are passed by pointer, and must not change during the note.
+ *
+ * The instance is given a copy of the opcode, whose instrument instance is 
+ * a snapshot taken at init, rather than the opcode itself, so that on the 
+ * worker it does not read the instrument instance while Csound changes it. 
+ * The offset and end of each kperiod are passed with its inputs, and set 
+ * in the snapshot before `kontrol` is called. At its noteoff, the note 
+ * releases the job without waiting for the worker; once the call to 
+ * `kontrol` that the worker may be making has returned, the worker calls 
+ * `noteoff` on the instance, with the copy of the opcode, returns the 
+ * instance to its factory, and deletes the job.
+ */
+struct CxxOffloadJob {
+    CxxOffloadJob(CSOUND *csound_, const OPDS &opds_, const CxxFactory *factory_, CxxInvokable *invokable_, size_t latency_, const std::vector<uint32_t> &input_sizes_, const std::vector<MYFLT *> &inputs_, const std::vector<uint32_t> &output_sizes_) :
+        csound(csound_),
+        opds(opds_),
+        insds(*opds_.insdshead),
+        factory(factory_),
+        invokable(invokable_),
+        latency(latency_),
+        input_sizes(input_sizes_),
+        passed_inputs(inputs_),
+        output_sizes(output_sizes_),
+        input_ring(latency_ + 1, KPERIOD_VALUES + std::accumulate(input_sizes_.begin(), input_sizes_.end(), size_t(0))),
+        output_ring(latency_ + 1, std::accumulate(output_sizes_.begin(), output_sizes_.end(), size_t(0))),
+        kontrol_inputs(inputs_),
+        kontrol_outputs(output_sizes_.size())
+    {
+        opds.insdshead = &insds;
+    }
+    enum {
+        // The offset and end of the kperiod, which precede the inputs in 
+        // each block.
+        KPERIOD_VALUES = 2
+    };
+    CSOUND *csound;
+    // The copy of the opcode, and the snapshot of its instrument instance.
+    OPDS opds;
+    INSDS insds;
+    const CxxFactory *factory;
+    CxxInvokable *invokable;
+    size_t latency;
+    // The number of values of each input or output in a block: ksmps for 
+    // a-rate, 1 for scalars, and 0 for inputs that are passed by pointer.
+    std::vector<uint32_t> input_sizes;
+    std::vector<MYFLT *> passed_inputs;
+    std::vector<uint32_t> output_sizes;
+    CxxBlockRing input_ring;
+    CxxBlockRing output_ring;
+    // The arguments of `kontrol`, which point into the rings.
+    std::vector<MYFLT *> kontrol_inputs;
+    std::vector<MYFLT *> kontrol_outputs;
+    // The kperiod of the note, counted by the Csound thread.
+    uint64_t kperiod = 0;
+    std::atomic<uint64_t> late_kperiods{0};
+    std::atomic<int> result{OK};
+    // Set by the note once it no longer uses the job.
+    std::atomic<bool> stop_requested{false};
+    // The next job submitted to the worker before this one.
+    CxxOffloadJob *next = nullptr;
+    /**
+     * Called by the note on the Csound thread every kperiod.
+     */
+    int exchange(MYFLT **outputs, MYFLT **inputs, const INSDS &instrument) {
+        uint64_t sequence = 0;
+        auto block = output_ring.front(sequence);
+        while (block != nullptr && sequence + latency < kperiod) {
+            output_ring.pop();
+            block = output_ring.front(sequence);
+        }
+        if (block != nullptr && sequence + latency == kperiod) {
+            for (size_t i = 0; i < output_sizes.size(); ++i) {
+                std::memcpy(outputs[i], block, output_sizes[i] * sizeof(MYFLT));
+                block += output_sizes[i];
+            }
+            output_ring.pop();
+        } else {
+            for (size_t i = 0; i < output_sizes.size(); ++i) {
+                std::memset(outputs[i], 0, output_sizes[i] * sizeof(MYFLT));
+            }
+            if (kperiod >= latency) {
+                late_kperiods++;
+            }
+        }
+        auto slot = input_ring.back();
+        if (slot != nullptr) {
+            *slot++ = instrument.ksmps_offset;
+            *slot++ = instrument.ksmps_no_end;
+            for (size_t i = 0; i < input_sizes.size(); ++i) {
+                std::memcpy(slot, inputs[i], input_sizes[i] * sizeof(MYFLT));
+                slot += input_sizes[i];
+            }
+            input_ring.push(kperiod);
+        }
+        kperiod++;
+        return result.load(std::memory_order_relaxed);
+    }
+    /**
+     * Called by the note on the Csound thread at its noteoff, after which 
+     * the note no longer uses the job. Does not wait for the worker.
+     */
+    void release() {
+        stop_requested.store(true, std::memory_order_release);
+    }
+    /**
+     * Called by the worker. Computes the outputs of the next block of 
+     * inputs, if there is one and there is room for the outputs, and the 
+     * job has not been released. Returns true if a block has been computed.
+     */
+    bool process() {
+        if (stop_requested.load(std::memory_order_acquire) == true) {
+            return false;
+        }
+        uint64_t sequence = 0;
+        auto input_block = input_ring.front(sequence);
+        if (input_block == nullptr) {
+            return false;
+        }
+        auto output_block = output_ring.back();
+        if (output_block == nullptr) {
+            return false;
+        }
+        insds.ksmps_offset = (uint32_t) *input_block++;
+        insds.ksmps_no_end = (uint32_t) *input_block++;
+        for (size_t i = 0; i < input_sizes.size(); ++i) {
+            if (input_sizes[i] > 0) {
+                kontrol_inputs[i] = input_block;
+                input_block += input_sizes[i];
+            }
+        }
+        for (size_t i = 0; i < output_sizes.size(); ++i) {
+            kontrol_outputs[i] = output_block;
+            output_block += output_sizes[i];
+        }
+        int result_ = OK;
+        if (cxx_profile_enabled()) {
+            auto start = cxx_nanoseconds();
+            result_ = invokable->kontrol(csound, kontrol_outputs.data(), kontrol_inputs.data());
+            factory->profile->record(CxxProfile::KONTROL, cxx_nanoseconds() - start);
+        } else {
+            result_ = invokable->kontrol(csound, kontrol_outputs.data(), kontrol_inputs.data());
+        }
+        if (result_ != OK) {
+            result = result_;
+        }
+        input_ring.pop();
+        output_ring.push(sequence);
+        return true;
+    }
+    /**
+     * Called by the worker, which no longer calls `kontrol`, to turn off 
+     * the instance and return it to its factory. Returns true if the 
+     * module of the factory is to be unloaded.
+     */
+    bool turn_off() {
+        if (cxx_profile_enabled()) {
+            auto start = cxx_nanoseconds();
+            invokable->noteoff(csound);
+            factory->profile->record(CxxProfile::NOTEOFF, cxx_nanoseconds() - start);
+        } else {
+            invokable->noteoff(csound);
+        }
+        factory->release(invokable);
+        invokable = nullptr;
+        return factory->unacquire();
+    }
+};
+
+struct CxxContext;
+static void cxx_collect_modules(CxxContext &context);
+
+/**
+ * Runs the `kontrol` methods of the instances that `cxx_invoke` runs with 
+ * `i_thread` 4 on a background thread of the Csound instance, so that 
+ * instances that are too costly for the audio thread use another core. The 
+ * notes submit their jobs, and wake the worker, without taking a lock; if a 
+ * wakeup is missed, the worker looks for work again after a millisecond. 
+ * The worker also turns off the instances of the jobs that the notes have 
+ * released, and deletes the jobs, so that no note waits for the worker.
+ */
+class CxxOffloadWorker {
+public:
+    CxxOffloadWorker(CxxContext &context_) : context(context_), worker(&CxxOffloadWorker::run, this) {}
+    /**
+     * Stops the worker, and turns off the instances of the jobs that it 
+     * has not deleted, including those of notes that are still running, 
+     * which there should not be.
+     */
+    ~CxxOffloadWorker() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping = true;
+        }
+        condition.notify_all();
+        worker.join();
+        receive();
+        bool collect = false;
+        for (auto job : jobs) {
+            if (job->turn_off()) {
+                collect = true;
+            }
+            delete job;
+        }
+        if (collect) {
+            cxx_collect_modules(context);
+        }
+    }
+    /**
+     * Hands the job over to the worker, which owns it from now on.
+     */
+    CxxOffloadJob *submit(std::unique_ptr<CxxOffloadJob> job_) {
+        auto job = job_.release();
+        job->next = submitted.load(std::memory_order_relaxed);
+        while (submitted.compare_exchange_weak(job->next, job, std::memory_order_release, std::memory_order_relaxed) == false) {
+        }
+        wake();
+        return job;
+    }
+    void wake() {
+        work.store(true, std::memory_order_release);
+        condition.notify_one();
+    }
+private:
+    /**
+     * Moves the submitted jobs to the jobs of the worker, in the order in 
+     * which they were submitted.
+     */
+    void receive() {
+        auto job = submitted.exchange(nullptr, std::memory_order_acquire);
+        auto first = jobs.size();
+        for (; job != nullptr; job = job->next) {
+            jobs.push_back(job);
+        }
+        std::reverse(jobs.begin() + first, jobs.end());
+    }
+    void run() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                condition.wait_for(lock, std::chrono::milliseconds(1), [this]() {
+                    return stopping || work.load(std::memory_order_acquire);
+                });
+                if (stopping) {
+                    return;
+                }
+                work.store(false, std::memory_order_relaxed);
+            }
+            receive();
+            bool processed = true;
+            while (processed) {
+                processed = false;
+                for (auto job : jobs) {
+                    while (job->process()) {
+                        processed = true;
+                    }
+                }
+            }
+            // The worker is not the audio thread, so it unloads modules 
+            // itself.
+            bool collect = false;
+            jobs.erase(std::remove_if(jobs.begin(), jobs.end(), [&](CxxOffloadJob *job) {
+                if (job->stop_requested.load(std::memory_order_acquire) == false) {
+                    return false;
+                }
+                if (job->turn_off()) {
+                    collect = true;
+                }
+                delete job;
+                return true;
+            }), jobs.end());
+            if (collect) {
+                cxx_collect_modules(context);
+            }
+        }
+    }
+    CxxContext &context;
+    std::mutex mutex_;
+    std::condition_variable condition;
+    std::atomic<CxxOffloadJob *> submitted{nullptr};
+    // The jobs that the worker has received, which only it uses.
+    std::vector<CxxOffloadJob *> jobs;
+    std::atomic<bool> work{false};
+    bool stopping = false;
+    std::thread worker;
+};
+
+/**
+ * Unloads the modules of the Csound instance that are no longer used on a 
+ * background thread, so that the noteoff of the last note of a module 
+ * that has been replaced or unloaded, which may run on the audio thread, 
+ * neither takes the lock of the context nor closes the module itself. The 
+ * thread is started by `cxx_reload` and `cxx_unload`, which are the only 
+ * opcodes that retire factories, and is woken like the offload worker; a 
+ * missed wakeup delays the collection by at most 10 milliseconds.
+ */
+class CxxModuleCollector {
+public:
+    CxxModuleCollector(CxxContext &context_) : context(context_) {}
+    ~CxxModuleCollector() {
+        stop();
+    }
+    /**
+     * Starts the thread, unless it has been started or stopped. Must not 
+     * be called on the audio thread.
+     */
+    void start() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (stopping == false && worker.joinable() == false) {
+            worker = std::thread(&CxxModuleCollector::run, this);
+        }
+    }
+    /**
+     * Stops the thread, after which modules must be collected by the 
+     * caller.
+     */
+    void stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopping = true;
+        }
+        condition.notify_all();
+        if (worker.joinable()) {
+            worker.join();
+        }
+    }
+    /**
+     * Asks the thread to collect the modules, without taking a lock.
+     */
+    void request() {
+        pending.store(true, std::memory_order_release);
+        condition.notify_one();
+    }
+private:
+    void run() {
+        while (true) {
+            {
+                std::unique_lock<std::mutex> lock(mutex_);
+                condition.wait_for(lock, std::chrono::milliseconds(10), [this]() {
+                    return stopping || pending.load(std::memory_order_acquire);
+                });
+                if (stopping) {
+                    return;
+                }
+            }
+            if (pending.exchange(false, std::memory_order_acq_rel)) {
+                cxx_collect_modules(context);
+            }
+        }
+    }
+    CxxContext &context;
+    std::mutex mutex_;
+    std::condition_variable condition;
+    std::atomic<bool> pending{false};
+    bool stopping = false;
+    std::thread worker;
+};
+
+/**
+ * The named buses of one Csound instance, which modules find with `cxx_bus` 
+ * through the `CxxBusRegistry` in the global variable `cxx_opcodes_buses`. 
+ * Buses are trivially destructible, so they are freed without calling code 
+ * in the modules that created them, which may have been unloaded.
+ */
+class CxxBusTable {
+public:
+    CxxBusTable(const std::atomic<bool> &diagnostics_enabled_) : diagnostics_enabled(diagnostics_enabled_) {}
+    ~CxxBusTable() {
+        for (auto &entry : buses) {
+            ::operator delete(entry.second.memory, std::align_val_t(entry.second.alignment));
+        }
+    }
+    void *acquire(CSOUND *csound, const char *name, const char *kind, size_t size, size_t alignment, void (*construct)(void *memory)) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = buses.find(name);
+        if (it != buses.end()) {
+            if (it->second.kind != kind || it->second.size != size) {
+                csound->Message(csound, "WARNING: cxx_bus: \"%s\" is a %s, not a %s.\n", name, it->second.kind.c_str(), kind);
+                return nullptr;
+            }
+            return it->second.memory;
+        }
+        auto memory = ::operator new(size, std::align_val_t(alignment));
+        std::memset(memory, 0, size);
+        construct(memory);
+        buses[name] = {kind, size, alignment, memory};
+        if (diagnostics_enabled) {
+            csound->Message(csound, "####### cxx_bus: created \"%s\", a %s of %zu bytes.\n", name, kind, size);
+        }
+        return memory;
+    }
+private:
+    struct Bus {
+        std::string kind;
+        size_t size;
+        size_t alignment;
+        void *memory;
+    };
+    const std::atomic<bool> &diagnostics_enabled;
+    std::mutex mutex;
+    std::map<std::string, Bus> buses;
+};
+
+/**
+ * The state of these opcodes for one Csound instance: the modules that it 
+ * has started, the factories that it has found in them, and the 
+ * compilations that it has submitted. Each Csound instance has its own 
+ * context, stored in a Csound global variable, so that several instances 
+ * in one process, e.g. one per core for offline rendering, neither see each 
+ * other's modules nor contend for each other's locks. Only the compile 
+ * cache and the lists of temporary files are shared by the process.
+ */
+struct CxxContext {
+    CxxContext(CSOUND *csound_) : csound(csound_) {}
+    CSOUND *csound;
+    // Set by the compiler command of the most recent compilation, and read 
+    // by notes on any thread.
+    std::atomic<bool> diagnostics_enabled{false};
+    // Serializes changes to the loaded modules and the factory registry.
+    std::mutex mutex;
+    // The modules started by this Csound instance, in search order.
+    std::vector<void *> loaded_modules;
+    // The entry point with which each loaded module was started, so that 
+    // it can be unloaded by `cxx_unload`.
+    std::map<void *, std::string> entry_points;
+    // The modules whose entry points have registered native opcodes with 
+    // `cxx_append_opcode`. Csound cannot remove opcodes, so these modules 
+    // are only unloaded when the Csound instance is destroyed.
+    std::set<void *> opcode_modules;
+    // Incremented whenever `loaded_modules` changes, so that opcodes waiting 
+    // for a factory know when to look for it again, and so that factories 
+    // bound to opcodes are revalidated.
+    std::atomic<uint64_t> modules_generation{0};
+    CxxFactoryRegistry factory_registry{mutex, loaded_modules, diagnostics_enabled};
+    CxxBindingCache binding_cache;
+    CxxCompileQueue compile_queue;
+    // Started by the first note of `cxx_invoke` with `i_thread` 4, and 
+    // deleted when the Csound instance is destroyed.
+    std::atomic<CxxOffloadWorker *> offload_worker{nullptr};
+    CxxBusTable buses{diagnostics_enabled};
+    CxxModuleCollector module_collector{*this};
+};
+
+/**
+ * Returns the context of the Csound instance, which is created when the 
+ * opcodes are initialized, and deleted when they are destroyed.
+ */
+static CxxContext *cxx_context(CSOUND *csound) {
+    auto context = (CxxContext **) csound->QueryGlobalVariableNoCheck(csound, "cxx_opcodes_context");
+    if (context == nullptr) {
+        return nullptr;
+    }
+    return *context;
+}
+
+/**
+ * Implements `CxxBusRegistry::acquire` for the context of the Csound instance.
+ */
+static void *cxx_bus_acquire(CSOUND *csound, const char *name, const char *kind, size_t size, size_t alignment, void (*construct)(void *memory)) {
+    auto context = cxx_context(csound);
+    if (context == nullptr) {
+        return nullptr;
+    }
+    return context->buses.acquire(csound, name, kind, size, alignment, construct);
+}
+
+/**
+ * Unloads the code of a module that is no longer used, and closes its 
+ * memory file.
+ */
+static void cxx_release_module(void *module_handle) {
+    cxx_unload_library(module_handle);
+#if !defined(WIN32)
+    std::lock_guard<std::mutex> lock(get_mutex());
+    auto memory_file = memory_files().find(module_handle);
+    if (memory_file != memory_files().end()) {
+        close(memory_file->second);
+        memory_files().erase(memory_file);
+    }
+#endif
+}
+
+/**
+ * Unloads the modules replaced by `cxx_reload` or unloaded by `cxx_unload` 
+ * that are no longer used, except those that have registered opcodes, then 
+ * deletes what the registry and the binding cache have retired, if no 
+ * lookup is in progress.
+ */
+static void cxx_collect_modules(CxxContext &context) {
+    std::vector<void *> unloaded;
+    {
+        std::lock_guard<std::mutex> lock(context.mutex);
+        unloaded = context.factory_registry.collect(context.csound);
+        for (auto module_handle : unloaded) {
+            context.entry_points.erase(module_handle);
+        }
+        if (context.factory_registry.reclaim()) {
+            context.binding_cache.reclaim();
+        }
+        unloaded.erase(std::remove_if(unloaded.begin(), unloaded.end(), [&](void *module_handle) {
+            return context.opcode_modules.count(module_handle) != 0;
+        }), unloaded.end());
+    }
+    for (auto module_handle : unloaded) {
+        cxx_release_module(module_handle);
+    }
+}
+
+/**
+ * Returns the factory with this name, resolving it if need be, then has 
+ * the modules whose collection was deferred while factories were being 
+ * resolved unloaded. The caller must hold a `CxxFactoryRegistry::Reader`.
+ */
+static const CxxFactory *cxx_resolve_factory(CxxContext &context, CSOUND *csound, const char *name) {
+    auto factory = context.factory_registry.resolve(csound, name);
+    if (context.factory_registry.collect_deferred()) {
+        context.module_collector.request();
+    }
+    return factory;
+}
+
+/**
+ * Adds a loaded module to this Csound instance and calls its entry point. 
+ * A module loaded by `cxx_reload` comes first in the search order, and 
+ * replaces the registered factories that it defines. Must be called from a 
+ * Csound thread.
+ */
+static int cxx_start_module(CSOUND *csound, CxxCompilation &compilation) {
+    auto time = cxx_nanoseconds();
+    auto &context = *cxx_context(csound);
+    int replaced = 0;
+    {
+        std::lock_guard<std::mutex> lock(context.mutex);
+        auto &modules = context.loaded_modules;
+        if (std::find(modules.begin(), modules.end(), compilation.module_handle) == modules.end()) {
+            context.entry_points[compilation.module_handle] = compilation.entry_point;
+            if (compilation.reload) {
+                modules.insert(modules.begin(), compilation.module_handle);
+                replaced = context.factory_registry.module_reloaded(csound, compilation.module_handle);
+            } else {
+                modules.push_back(compilation.module_handle);
+                context.factory_registry.module_loaded(csound, compilation.module_handle);
+            }
+        } else if (compilation.reload) {
+            // The source code has not changed, so the loader returned the 
+            // module that is already loaded.
+            csound->Message(csound, "cxx_reload: module \"%s\" is unchanged.\n", compilation.entry_point.c_str());
+            cxx_unload_library(compilation.module_handle);
+            return OK;
+        } else {
+            // The same module was compiled again, and the loader has counted 
+            // one more reference to it.
+            cxx_unload_library(compilation.module_handle);
+        }
+        context.modules_generation++;
+    }
+    if (compilation.reload) {
+        if (compilation.diagnostics_enabled) {
+            csound->Message(csound, "####### cxx_reload: replaced factories:     %d\n", replaced);
+        }
+        context.module_collector.start();
+        cxx_collect_modules(context);
+    }
+    csound_main_t entry_point_symbol = (csound_main_t) cxx_module_symbol(csound, compilation.module_handle, compilation.entry_point.c_str());
+    time = compilation.record_phase("resolve_entry_point", time);
+    if (compilation.diagnostics_enabled) {
+        csound->Message(csound, "####### cxx_compile: module_filepath:    %s\n", compilation.module_filepath.c_str());
+        csound->Message(csound, "####### cxx_compile: module_handle:      %p\n", compilation.module_handle);
+        csound->Message(csound, "####### cxx_compile: entry_point:        %s\n", compilation.entry_point.c_str());
+        csound->Message(csound, "####### cxx_compile: entry_point_symbol: %p\n", entry_point_symbol);
+    }
+    if (entry_point_symbol == nullptr) {
+        csound->Message(csound, "Error: cxx_compile: entry point \"%s\" not found in %s\n", compilation.entry_point.c_str(), compilation.module_filepath.c_str());
+        return NOTOK;
+    }
+    // The count is missing only if these opcodes were not initialized for 
+    // this Csound instance, in which case `cxx_append_opcode` fails too.
+    auto opcode_count = (int *) csound->QueryGlobalVariableNoCheck(csound, "cxx_opcodes_native_opcodes");
+    auto opcodes_before = opcode_count == nullptr ? 0 : *opcode_count;
+    auto result = entry_point_symbol(csound);
+    compilation.record_phase("entry_point", time);
+    if (opcode_count != nullptr && *opcode_count != opcodes_before) {
+        if (compilation.diagnostics_enabled) {
+            csound->Message(csound, "####### cxx_compile: native opcodes:     %d\n", *opcode_count - opcodes_before);
+        }
+        std::lock_guard<std::mutex> lock(context.mutex);
+        context.opcode_modules.insert(compilation.module_handle);
+    }
+    return result;
+}
+
+/**
+ * The number of Csound instances that have initialized these opcodes and 
+ * have not yet been destroyed.
+ */
+static std::atomic<int> &cxx_csound_instances() {
+    static std::atomic<int> instances{0};
+    return instances;
+}
+
+/**
+ * Unloads the modules started by the Csound instance of the context, or 
+ * only those that were started with this entry point. A module whose 
+ * factories still have running notes is unloaded when the last of these 
+ * notes ends. Returns the number of modules.
+ */
+static int cxx_unload_modules(CxxContext &context, const char *entry_point) {
+    int count = 0;
+    {
+        std::lock_guard<std::mutex> lock(context.mutex);
+        auto &entry_points = context.entry_points;
+        auto &modules = context.loaded_modules;
+        for (auto it = entry_points.begin(); it != entry_points.end(); ) {
+            if (entry_point != nullptr && it->second != entry_point) {
+                ++it;
+                continue;
+            }
+            auto module_handle = it->first;
+            modules.erase(std::remove(modules.begin(), modules.end(), module_handle), modules.end());
+            context.factory_registry.module_unloaded(module_handle);
+            if (context.diagnostics_enabled) context.csound->Message(context.csound, "####### cxx_unload: retired module:           %p \"%s\"\n", module_handle, it->second.c_str());
+            if (entry_point != nullptr && context.opcode_modules.count(module_handle) != 0) {
+                context.csound->Message(context.csound, "WARNING: cxx_unload: module \"%s\" has registered opcodes, so its code stays loaded until the end of the performance.\n", entry_point);
+            }
+            it = entry_points.erase(it);
+            count++;
+        }
+        if (count > 0) {
+            context.modules_generation++;
+        }
+    }
+    if (count > 0) {
+        context.module_collector.start();
+    }
+    cxx_collect_modules(context);
+    return count;
+}
+
+/**
+ * Reports how long each phase of the compilation took, if diagnostics or 
+ * telemetry are enabled, as one JSON record that is printed and, if 
+ * `CXX_OPCODES_TELEMETRY_LOG` is set, appended to that file.
+ */
+static void cxx_report_compilation(CSOUND *csound, const CxxCompilation &compilation, int result) {
+    if (compilation.diagnostics_enabled == false && cxx_telemetry_enabled() == false) {
+        return;
+    }
+    double total = 0;
+    std::string record = "{\"entry_point\": " + json_string(compilation.entry_point);
+    record += ", \"module\": " + json_string(compilation.module_filepath);
+    record += ", \"cache_hit\": " + std::string(compilation.cache_hit ? "true" : "false");
+    record += ", \"result\": " + std::to_string(result);
+    if (compilation.time_trace_filepath.empty() == false) {
+        record += ", \"time_trace\": " + json_string(compilation.time_trace_filepath);
+    }
+    record += ", \"phases\": [";
+    char buffer[0x40];
+    for (size_t i = 0; i < compilation.phases.size(); ++i) {
+        const auto &phase = compilation.phases[i];
+        std::snprintf(buffer, sizeof(buffer), "%.3f", phase.milliseconds);
+        record += (i == 0 ? "{\"phase\": " : ", {\"phase\": ") + json_string(phase.name);
+        if (phase.detail.empty() == false) {
+            record += ", \"detail\": " + json_string(phase.detail);
+        }
+        record += ", \"ms\": " + std::string(buffer) + "}";
+        total += phase.milliseconds;
+    }
+    std::snprintf(buffer, sizeof(buffer), "%.3f", total);
+    record += "], \"total_ms\": " + std::string(buffer) + "}";
+    csound->Message(csound, "####### cxx_compile: telemetry:          %s\n", record.c_str());
+    auto log_filepath = std::getenv("CXX_OPCODES_TELEMETRY_LOG");
+    if (log_filepath != nullptr && std::strlen(log_filepath) > 0) {
+        std::lock_guard lock(get_mutex());
+        auto file_ = std::fopen(log_filepath, "a");
+        if (file_ == nullptr) {
+            csound->Message(csound, "WARNING: cxx_compile: could not write telemetry to %s.\n", log_filepath);
+            return;
+        }
+        std::fprintf(file_, "%s\n", record.c_str());
+        std::fclose(file_);
+    }
+}
+
+/**
+ * Sets up a compilation from the arguments of a compiling opcode, which 
+ * are the same for `cxx_compile` and `cxx_compile_async`. Turns on 
+ * diagnostics if the compiler command contains `-v`.
+ */
+static void cxx_prepare_compilation(CSOUND *csound, OPDS *opds, STRINGDAT *S_entry_point, STRINGDAT *S_source_code, STRINGDAT *S_compiler_command, STRINGDAT *S_dynamic_link_libraries, STRINGDAT *S_prelude_headers, CxxCompilation &compilation) {
+    compilation.diagnostics_enabled = false;
+    // Parse the compiler options.
+    auto cxx_command = csound->strarg2name(csound, (char *)0, S_compiler_command->data, (char *)"", 1);
+    std::vector<std::string> tokens;
+    tokenize(cxx_command, ' ', tokens);
+    for (size_t i = 0; i < tokens.size(); ++i) {
+        if (tokens[i] == "-v") {
+            compilation.diagnostics_enabled = true;
+        }
+    }
+    cxx_context(csound)->diagnostics_enabled = compilation.diagnostics_enabled;
+    cxx_diagnostics_enabled() = compilation.diagnostics_enabled;
+    compilation.orchestra_line = opds->optext->t.linenum;
+    compilation.entry_point = csound->strarg2name(csound, (char *)0, S_entry_point->data, (char *)"", 1);
+    compilation.source_code = csound->strarg2name(csound, (char *)0, S_source_code->data, (char *)"", 1);
+    compilation.compiler_command = S_compiler_command->data;
+    // The optional dynamic link libraries are present only if the opcode 
+    // was given four input arguments.
+    if (opds->optext->t.inArgCount > 3 && S_dynamic_link_libraries != nullptr) {
+        compilation.dynamic_link_libraries = csound->strarg2name(csound, (char *)0, S_dynamic_link_libraries->data, (char *)"", 1);
+    }
+    // The optional prelude headers are present only if the opcode was 
+    // given five input arguments.
+    if (opds->optext->t.inArgCount > 4 && S_prelude_headers != nullptr) {
+        compilation.prelude_headers = csound->strarg2name(csound, (char *)0, S_prelude_headers->data, (char *)"", 1);
+    }
+}
+
+class CxxCompile : public csound::OpcodeBase<CxxCompile>
+{
+public:
+    // OUTPUTS
+    MYFLT *i_result;
+    // INPUTS
+    STRINGDAT *S_entry_point;
+    STRINGDAT *S_source_code;
+    // Compiler name and all compiler options except for source code filename,
+    // output name, and dynamic link libraries.
+    STRINGDAT *S_compiler_command;
+    // All dynamic link libraries required by the compiler command.
+    STRINGDAT *S_dynamic_link_libraries;
+    // Headers to precompile and include in the module.
+    STRINGDAT *S_prelude_headers;
+    // STATE
+    /**
+     * This is an i-time only opcode. Everything happens in init.
+     */
+    int init(CSOUND *csound)
+    {
+        CxxCompilation compilation;
+        cxx_prepare_compilation(csound, &opds, S_entry_point, S_source_code, S_compiler_command, S_dynamic_link_libraries, S_prelude_headers, compilation);
+        // Compile the source code to a module, and call its
+        // csound_main entry point.
+        int result = cxx_build_module(compilation);
+        compilation.flush_log(csound);
+        if (result == 0) {
+            result = cxx_start_module(csound, compilation);
+        }
+        cxx_report_compilation(csound, compilation, result);
+        return result;
+    };
+};
+
+/**
+ * Starts the module of a job that has been built, unless another opcode has 
+ * already done so. Must be called from a Csound thread.
+ */
+static void cxx_start_job(CSOUND *csound, CxxCompileJob &job) {
+    if (job.claimed.exchange(true) == true) {
+        return;
+    }
+    job.compilation.flush_log(csound);
+    int status = CxxCompileJob::FAILED;
+    int result = job.compilation.result;
+    if (job.build_status == CxxCompileJob::READY) {
+        result = cxx_start_module(csound, job.compilation);
+        if (result == OK) {
+            status = CxxCompileJob::READY;
+        }
+    } else {
+        csound->Message(csound, "Error: cxx_compile: compilation of \"%s\" failed with result %d.\n", job.compilation.entry_point.c_str(), job.compilation.result);
+    }
+    cxx_report_compilation(csound, job.compilation, result);
+    cxx_context(csound)->compile_queue.started();
+    job.status = status;
+}
+
+/**
+ * Like `cxx_compile`, but returns at once with a handle to the compilation, 
+ * which runs on a background thread. Use `cxx_compile_status` to find out 
+ * when the module is ready, and to start it.
+ */
+class CxxCompileAsync : public csound::OpcodeBase<CxxCompileAsync>
+{
+public:
+    // OUTPUTS
+    MYFLT *i_handle;
+    // INPUTS
+    STRINGDAT *S_entry_point;
+    STRINGDAT *S_source_code;
+    STRINGDAT *S_compiler_command;
+    STRINGDAT *S_dynamic_link_libraries;
+    STRINGDAT *S_prelude_headers;
+    // STATE
+    /**
+     * This is an i-time only opcode. Everything happens in init.
+     */
+    int init(CSOUND *csound)
+    {
+        auto job = std::make_shared<CxxCompileJob>();
+        cxx_prepare_compilation(csound, &opds, S_entry_point, S_source_code, S_compiler_command, S_dynamic_link_libraries, S_prelude_headers, job->compilation);
+        *i_handle = cxx_context(csound)->compile_queue.submit(job);
+        if (job->compilation.diagnostics_enabled) {
+            csound->Message(csound, "####### cxx_compile_async: handle:       %d entry_point: %s\n", (int) *i_handle, job->compilation.entry_point.c_str());
+        }
+        return OK;
+    };
+};
+
+/**
+ * Like `cxx_compile_async`, but when the module is started, the factories 
+ * that it defines replace the registered factories of the same names. New 
+ * `cxx_invoke` notes use the new code, while running notes keep the old 
+ * code until their noteoff, unless their `CxxInvokable` migrates its state 
+ * to an instance from the new module. Once no note uses the old module, it 
+ * is unloaded.
+ */
+class CxxReload : public csound::OpcodeBase<CxxReload>
+{
+public:
+    // OUTPUTS
+    MYFLT *i_handle;
+    // INPUTS
+    STRINGDAT *S_entry_point;
+    STRINGDAT *S_source_code;
+    STRINGDAT *S_compiler_command;
+    STRINGDAT *S_dynamic_link_libraries;
+    STRINGDAT *S_prelude_headers;
+    // STATE
+    /**
+     * This is an i-time only opcode. Everything happens in init.
+     */
+    int init(CSOUND *csound)
+    {
+        auto job = std::make_shared<CxxCompileJob>();
+        cxx_prepare_compilation(csound, &opds, S_entry_point, S_source_code, S_compiler_command, S_dynamic_link_libraries, S_prelude_headers, job->compilation);
+        job->compilation.reload = true;
+#if defined(__linux__) || (defined(__unix__) && !defined(__APPLE__))
+        // The new module must call its own definitions of symbols that the 
+        // replaced module also defines, not those of the replaced module, 
+        // which the loader would otherwise find first in global scope.
+        job->compilation.compiler_command += " -Wl,-Bsymbolic";
+#endif
+        *i_handle = cxx_context(csound)->compile_queue.submit(job);
+        if (job->compilation.diagnostics_enabled) {
+            csound->Message(csound, "####### cxx_reload: handle:              %d entry_point: %s\n", (int) *i_handle, job->compilation.entry_point.c_str());
+        }
+        return OK;
+    };
+};
+
+/**
+ * Unloads the modules that this Csound instance started with the entry 
+ * point. Their factories can no longer be used by new notes, and each 
+ * module is unloaded as soon as no running note uses it.
+ */
+class CxxUnload : public csound::OpcodeBase<CxxUnload>
+{
+public:
+    // OUTPUTS
+    MYFLT *i_count;
+    // INPUTS
+    STRINGDAT *S_entry_point;
+    // STATE
+    /**
+     * This is an i-time only opcode. Everything happens in init.
+     */
+    int init(CSOUND *csound)
+    {
+        *i_count = cxx_unload_modules(*cxx_context(csound), S_entry_point->data);
+        if (*i_count == 0) {
+            csound->Message(csound, "WARNING: cxx_unload: no module was started with entry point \"%s\".\n", S_entry_point->data);
+        }
+        return OK;
+    };
+};
+
+/**
+ * Reports the status of a compilation submitted by `cxx_compile_async`: 0 
+ * while it is pending, 1 once the module has been loaded and its entry 
+ * point has been called, and -1 if it has failed. The first time the 
+ * compilation is found to be finished, the module is started on the 
+ * calling Csound thread.
+ */
+class CxxCompileStatus : public csound::OpcodeNoteoffBase<CxxCompileStatus>
+{
+public:
+    // OUTPUTS
+    MYFLT *k_status;
+    // INPUTS
+    MYFLT *i_handle;
+    // STATE
+    std::shared_ptr<CxxCompileJob> *job;
+    int init(CSOUND *csound)
+    {
+        // The opcode's memory is not constructed by Csound, so the job is 
+        // held through a separately allocated shared pointer.
+        job = new std::shared_ptr<CxxCompileJob>(cxx_context(csound)->compile_queue.job((int) *i_handle));
+        if (*job == nullptr) {
+            return csound->InitError(csound, "cxx_compile_status: invalid handle: %d\n", (int) *i_handle);
+        }
+        return kontrol(csound);
+    }
+    int kontrol(CSOUND *csound)
+    {
+        if (job == nullptr || *job == nullptr) {
+            *k_status = CxxCompileJob::FAILED;
+            return OK;
+        }
+        auto &job_ = *job;
+        if (job_->build_status != CxxCompileJob::PENDING) {
+            cxx_start_job(csound, *job_);
+        }
+        *k_status = job_->status;
+        return OK;
+    }
+    int noteoff(CSOUND *csound)
+    {
+        delete job;
+        job = nullptr;
+        return OK;
+    }
+};
+
+/**
+ * Waits for all compilations submitted by `cxx_compile_async`, which run in 
+ * parallel, and then starts their modules in the order in which they were 
+ * submitted. Modules already started by `cxx_compile_status` are skipped.
+ */
+class CxxCompileWait : public csound::OpcodeBase<CxxCompileWait>
+{
+public:
+    // OUTPUTS
+    MYFLT *i_failures;
+    // INPUTS
+    // STATE
+    /**
+     * This is an i-time only opcode. Everything happens in init.
+     */
+    int init(CSOUND *csound)
+    {
+        auto &context = *cxx_context(csound);
+        int failures = 0;
+        auto jobs = context.compile_queue.wait();
+        for (auto &job : jobs) {
+            cxx_start_job(csound, *job);
+            if (job->status == CxxCompileJob::FAILED) {
+                failures++;
+            }
+        }
+        if (context.diagnostics_enabled) {
+            csound->Message(csound, "####### cxx_compile_wait: jobs: %d failures: %d\n", (int) jobs.size(), failures);
+        }
+        *i_failures = failures;
+        return OK;
+    };
+};
+
+/**
+ * Resolves a `CxxInvokable` factory ahead of time, which creates and fills 
+ * its instance pool if the module defines one, so that the first notes do 
+ * not pay for that.
  */
-static std::vector<void *> &loaded_modules() {
-    static std::vector<void *> loaded_modules_;
-    return loaded_modules_;
-}
+class CxxPrewarm : public csound::OpcodeBase<CxxPrewarm>
+{
+public:
+    // OUTPUTS
+    MYFLT *i_pool_size;
+    // INPUTS
+    STRINGDAT *S_invokable_factory;
+    // STATE
+    /**
+     * This is an i-time only opcode. Everything happens in init.
+     */
+    int init(CSOUND *csound)
+    {
+        auto &context = *cxx_context(csound);
+        CxxFactoryRegistry::Reader reader(context.factory_registry);
+        auto factory = cxx_resolve_factory(context, csound, S_invokable_factory->data);
+        if (factory == nullptr) {
+            return csound->InitError(csound, "cxx_prewarm: invokable factory \"%s\" not found.\n", S_invokable_factory->data);
+        }
+        *i_pool_size = factory->pool == nullptr ? 0 : factory->pool->size();
+        return OK;
+    };
+};
 
 /**
- * The `cxx_compile` opcode will call a uniquely named function that must be 
- * defined in the module. The type of this function must be
- * `extern "C" int (*)(CSOUND *csound)`. This function serves as the entry 
- * point to the module, similar to 'main' in a C or C++ program.
- *
- * When the entry point is called, `csoundStart` has _already_ been called,
- * and Csound is performing an init pass, which for `cxx_compile` used in the
- * orchestra header will be the first init pass in the orchestra header
- * (that is, "instr 0").
+ * Clears the compile cache used by `cxx_compile`.
  */
-extern "C" {
-    typedef int (*csound_main_t)(CSOUND *csound);
+class CxxCacheClear : public csound::OpcodeBase<CxxCacheClear>
+{
+public:
+    // OUTPUTS
+    MYFLT *i_result;
+    // INPUTS
+    // STATE
+    /**
+     * This is an i-time only opcode. Everything happens in init.
+     */
+    int init(CSOUND *csound)
+    {
+        auto cache_directory = cxx_cache_directory();
+        cxx_cache_clear(cache_directory);
+        if (cxx_context(csound)->diagnostics_enabled) {
+            csound->Message(csound, "####### cxx_cache_clear: cleared:        %s\n", cache_directory.string().c_str());
+        }
+        *i_result = OK;
+        return OK;
+    };
 };
 
-static std::mutex &get_mutex() {
-    static std::mutex mutex_;
-    return mutex_;
-}
-
-class CxxCompile : public csound::OpcodeBase<CxxCompile>
+/**
+ * Reports the timing statistics collected for each factory when profiling 
+ * is enabled by `CXX_OPCODES_PROFILE`. With no filepath, the report is 
+ * printed as text; with a filepath, it is written to that file as JSON.
+ */
+class CxxProfileReport : public csound::OpcodeBase<CxxProfileReport>
 {
 public:
     // OUTPUTS
     MYFLT *i_result;
     // INPUTS
-    STRINGDAT *S_entry_point;
-    STRINGDAT *S_source_code;
-    // Compiler name and all compiler options except for source code filename,
-    // output name, and dynamic link libraries.
-    STRINGDAT *S_compiler_command;
-    // All dynamic link libraries required by the compiler command.
-    STRINGDAT *S_dynamic_link_libraries;
+    STRINGDAT *S_filepath;
     // STATE
     /**
      * This is an i-time only opcode. Everything happens in init.
      */
     int init(CSOUND *csound)
     {
-        cxx_diagnostics_enabled() = false;
-        // Parse the compiler options.
-        auto cxx_command = csound->strarg2name(csound, (char *)0, S_compiler_command->data, (char *)"", 1);
-        std::vector<const char*> args;
-        std::vector<std::string> tokens;
-        tokenize(cxx_command, ' ', tokens);
-        for (int i = 0; i < tokens.size(); ++i) {
-            if (tokens[i] == "-v") {
-                cxx_diagnostics_enabled() = true;
-            }
-            args.push_back(tokens[i].c_str());
-        }
-        //std::fprintf(stderr, "CxxCompile::init: line %d\n", __LINE__);
-        auto entry_point = csound->strarg2name(csound, (char *)0, S_entry_point->data, (char *)"", 1);
-        // Create a temporary file containing the source code.
-        auto source_code = csound->strarg2name(csound, (char *)0, S_source_code->data, (char *)"", 1);
-        char filepath[0x500];
-        {
-            std::lock_guard lock(get_mutex());
-            std::mt19937 mersenne_twister;
-            unsigned int seed_ = std::time(nullptr);
-            mersenne_twister.seed(seed_);
-            std::snprintf(filepath, 0x500, "%s/cxx_opcode_%lx.cpp", std::filesystem::temp_directory_path().c_str(), mersenne_twister());
-            auto file_ = fopen(filepath, "w+");
-            std::fwrite(source_code, strlen(source_code), sizeof(source_code[0]), file_);
-            std::fclose(file_);
-        }
-        args.push_back("cxx_opcode");
-        args.push_back(filepath);
-        char module_filepath[0x600];
-        std::snprintf(module_filepath, 0x600, "%s.so", filepath);
-        char compiler_command[0x2000];
-        std::snprintf(compiler_command, 0x2000, "%s %s -o%s\n", S_compiler_command->data, filepath, module_filepath);
-        if (cxx_diagnostics_enabled()) {    
-            csound->Message(csound, "####### cxx_compile: command:            %s\n", compiler_command);
-        }
-        auto result = std::system(compiler_command);
-        if (cxx_diagnostics_enabled()) {
-            csound->Message(csound, "####### cxx_compile: result:             %d\n", result);
+        *i_result = OK;
+        if (cxx_profile_enabled() == false) {
+            csound->Message(csound, "WARNING: cxx_profile: profiling is not enabled, set CXX_OPCODES_PROFILE=1.\n");
+            return OK;
         }
-        // Compile the source code to a module, and call its
-        // csound_main entry point.
-        if (result == 0) {
-            // First, preload dynamic link libraries required by our compiled 
-            // module.
-            if (S_dynamic_link_libraries != nullptr) {
-                std::vector<std::string> dynamic_link_library_names;
-                auto dynamic_link_libraries = csound->strarg2name(csound, (char *)0, S_dynamic_link_libraries->data, (char *)"", 1);
-                tokenize(dynamic_link_libraries, ' ', dynamic_link_library_names);
-                for (const auto &dynamic_link_library_name : dynamic_link_library_names) {
-                    void *module_handle = nullptr;
-                    auto library_result = cxx_load_library(dynamic_link_library_name.c_str());
-#if (defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)) 
-                    if (result != OK) {
-                            auto error_message = dlerror();
-                            csound->Message(csound, "Error: dlerror: \"%s\" when trying to load %s\n", error_message, dynamic_link_library_name.c_str());
-                    }
-#endif
-                    if (cxx_diagnostics_enabled() && library_result != nullptr) {
-                        csound->Message(csound, "####### cxx_compile: loaded dependency:  %s\n", dynamic_link_library_name.c_str());
-                    }
-                }
+        if (opds.optext->t.inArgCount > 0 && S_filepath != nullptr) {
+            if (cxx_profile_write(csound, cxx_context(csound)->factory_registry, S_filepath->data) == false) {
+                return csound->InitError(csound, "cxx_profile: could not write \"%s\".\n", S_filepath->data);
             }
-            // Then, load our compiled module.
-            void *module_handle = nullptr;
-            ///result = csound->OpenLibrary(&module_handle, module_filepath);
-            module_handle = cxx_load_library(module_filepath);
-#if (defined(__linux__) || defined(__unix__) || defined(_POSIX_VERSION)) 
-            ///if (result != OK) {
-            if (module_handle == nullptr) {
-                    auto error_message = dlerror();
-                    csound->Message(csound, "Error: dlerror: %s\n", error_message);
-            }
-#endif
-            loaded_modules().push_back(module_handle);
-            csound_main_t entry_point_symbol = (csound_main_t) csound->GetLibrarySymbol(module_handle, entry_point);
-            if (cxx_diagnostics_enabled()) {
-                csound->Message(csound, "####### cxx_compile: module_filepath:    %s\n", module_filepath);
-                csound->Message(csound, "####### cxx_compile: module_handle:      %p\n", module_handle);
-                csound->Message(csound, "####### cxx_compile: entry_point:        %s\n", entry_point);
-                csound->Message(csound, "####### cxx_compile: entry_point_symbol: %p\n", entry_point_symbol);
-            }
-            result = entry_point_symbol(csound);
+            return OK;
         }
-        return result;
+        csound->Message(csound, "%s", cxx_profile_report(csound, cxx_context(csound)->factory_registry, false).c_str());
+        return OK;
     };
 };
 
-#include "cxx_invokable.hpp"
+/**
+ * Sets all numeric outputs of an opcode to 0, e.g. while the `CxxInvokable` 
+ * that should compute them is still being compiled.
+ */
+static void zero_outputs(CSOUND *csound, OPDS *opds, MYFLT **outputs) {
+    auto output_count = opds->optext->t.outArgCount;
+    auto ksmps = opds->insdshead->ksmps;
+    for (unsigned int i = 0; i < output_count; ++i) {
+        auto type = csound->GetTypeForArg(outputs[i]);
+        if (type == nullptr) {
+            continue;
+        }
+        auto type_name = type->varTypeName;
+        if (std::strcmp(type_name, "a") == 0) {
+            std::memset(outputs[i], 0, ksmps * sizeof(MYFLT));
+        } else if (std::strcmp(type_name, "k") == 0 || std::strcmp(type_name, "i") == 0) {
+            *outputs[i] = 0;
+        }
+    }
+}
 
-static std::mutex invokable_mutex;
+/**
+ * Sets all outputs of an opcode whose outputs all have the same rate, 
+ * 'a' or 'k', to 0, without looking up their types.
+ */
+template<char RATE>
+static void zero_outputs(OPDS *opds, MYFLT **outputs) {
+    auto output_count = opds->optext->t.outArgCount;
+    auto ksmps = opds->insdshead->ksmps;
+    for (unsigned int i = 0; i < output_count; ++i) {
+        if (RATE == 'a') {
+            std::memset(outputs[i], 0, ksmps * sizeof(MYFLT));
+        } else {
+            *outputs[i] = 0;
+        }
+    }
+}
 
 /**
  * Assuming that `cxx_compile` has already compiled a module that
  * implements a `CxxInvokable`, creates an instance of that
- * `CxxInvokable` and invokes it.
+ * `CxxInvokable` and invokes it. If the factory is not found while 
+ * modules from `cxx_compile_async` are still pending, the outputs are 
+ * silent until the factory appears.
+ *
+ * Notes may start concurrently on several threads, including the audio 
+ * thread. Once the factory has been resolved and bound to the opcode, 
+ * neither finding it, nor taking an instance from its pool, nor calling 
+ * the instance takes a lock; only the first resolution of a factory does. 
+ * The last note of a replaced or unloaded module only wakes the module 
+ * collector, which unloads the module on its own thread.
  */
-class CxxInvoke : public csound::OpcodeNoteoffBase<CxxInvoke>
+template<int THREAD, char RATE = 0>
+class CxxInvokeOpcode : public csound::OpcodeNoteoffBase<CxxInvokeOpcode<THREAD, RATE>>
 {
 public:
+    using csound::OpcodeNoteoffBase<CxxInvokeOpcode<THREAD, RATE>>::opds;
     // OUTPUTS
     MYFLT *outputs[40];
     // INPUTS
@@ -256,64 +3647,388 @@ public:
    3 =     1  AND  2
  */
 
-    MYFLT *i_thread;
-    MYFLT *inputs[VARGMAX];
+    // For `cxx_invoke`, the thread followed by the inputs of the 
+    // `CxxInvokable`; for the typed variants, only the inputs.
+    MYFLT *arguments[VARGMAX + 1];
     // STATE
     int thread;
+    MYFLT **inputs;
+    CxxContext *context;
+    const CxxFactory *factory;
     CxxInvokable *cxx_invokable;
+    // The voice of this note, if the factory has a voice bank, or -1.
+    int voice;
+    // Set while waiting for the factory to be loaded.
+    bool pending;
+    uint64_t pending_generation;
+    // Set once the instance has declined to migrate to a reloaded module.
+    bool migration_declined;
+    // The job of an instance that runs on the offload worker, which owns it.
+    CxxOffloadJob *offload;
     int init(CSOUND *csound)
     {
-        std::lock_guard<std::mutex> lock(invokable_mutex);
         int result = OK;
-        thread = (int) *i_thread;
+        if (THREAD == 0) {
+            thread = (int) *arguments[0];
+            inputs = arguments + 1;
+        } else {
+            thread = THREAD;
+            inputs = arguments;
+        }
+        context = cxx_context(csound);
+        factory = nullptr;
+        cxx_invokable = nullptr;
+        voice = -1;
+        pending = false;
+        migration_declined = false;
+        offload = nullptr;
         // Look up factory.
         auto invokable_factory_name = S_invokable_factory->data;
-        if (cxx_diagnostics_enabled()) csound->Message(csound,     "####### cxx_invoke::init: invokable_factory_name:  \"%s\" cxx_invokable: %p\n", invokable_factory_name, cxx_invokable);
-        // Create instance. We simply search through all the dynamic link 
-        // libraries compiled and loaded by this Csound process. TODO: If it 
-        // turns out that there are hundreds of these, make this more 
-        // efficient.
-        for (auto module_handle : loaded_modules()) {
-            if (cxx_diagnostics_enabled()) csound->Message(csound, "####### cxx_invoke::init: library handle:          %p\n", module_handle);
-            auto invokable_factory = (CxxInvokable *(*)()) csound->GetLibrarySymbol(module_handle, invokable_factory_name);
+        if (context->diagnostics_enabled) csound->Message(csound,     "####### cxx_invoke::init: invokable_factory_name:  \"%s\" cxx_invokable: %p\n", invokable_factory_name, cxx_invokable);
+        CxxFactoryRegistry::Reader reader(context->factory_registry);
+        auto generation = context->modules_generation.load();
+        auto invokable_factory = context->binding_cache.find(opds.optext, invokable_factory_name, generation);
+        if (invokable_factory == nullptr) {
+            invokable_factory = cxx_resolve_factory(*context, csound, invokable_factory_name);
             if (invokable_factory != nullptr) {
-                if (cxx_diagnostics_enabled()) csound->Message(csound, "####### cxx_invoke::init: found invokable factory: %p\n", invokable_factory);
-                cxx_invokable= invokable_factory();
-                if (cxx_diagnostics_enabled()) csound->Message(csound, "####### cxx_invoke::init: created new invokable:   %p for thread: %d\n", cxx_invokable, thread);
-                 if (thread == 2) {
-                    return result;
-                }
-                // Invoke the instance.
-                result = cxx_invokable->init(csound, &opds, outputs, inputs);
-                if (cxx_diagnostics_enabled()) csound->Message(csound, "####### cxx_invoke::init: result of invokation:    %d\n", result);
+                context->binding_cache.bind(opds.optext, generation, invokable_factory);
+            }
+        }
+        if (invokable_factory == nullptr) {
+            if (RATE == 0 && context->compile_queue.unstarted() > 0) {
+                if (context->diagnostics_enabled) csound->Message(csound, "####### cxx_invoke::init: waiting for pending module to define \"%s\".\n", invokable_factory_name);
+                pending = true;
+                pending_generation = generation;
+                zero_outputs_(csound);
                 return result;
             }
+            return csound->InitError(csound, "cxx_invoke: invokable factory \"%s\" not found.\n", invokable_factory_name);
+        }
+        return create(csound, invokable_factory);
+    }
+    /**
+     * Zeros the outputs; the typed variants know the rate of their 
+     * outputs, and so need not look up their types.
+     */
+    void zero_outputs_(CSOUND *csound)
+    {
+        if (RATE == 0) {
+            zero_outputs(csound, &opds, outputs);
+        } else {
+            zero_outputs<RATE>(&opds, outputs);
+        }
+    }
+    /**
+     * Returns the thread, which is a constant for the typed variants, so 
+     * that their checks of the thread are compiled away.
+     */
+    int thread_() const
+    {
+        return THREAD == 0 ? thread : THREAD;
+    }
+    /**
+     * Creates the instance and, unless it runs only at k-rate, invokes its 
+     * `init` method. If the factory has a voice bank, adds a voice to the 
+     * bank instead.
+     */
+    int create(CSOUND *csound, const CxxFactory *invokable_factory)
+    {
+        int result = OK;
+        if (context->diagnostics_enabled) csound->Message(csound, "####### cxx_invoke::init: found invokable factory: %p\n", invokable_factory->create);
+        // A factory that `cxx_reload` replaced after it was looked up is 
+        // not used, nor is one that `cxx_unload` retired.
+        factory = invokable_factory;
+        factory->acquire();
+        while (factory->retired()) {
+            auto successor = factory->successor.load();
+            release_factory(csound);
+            if (successor == nullptr) {
+                return csound->InitError(csound, "cxx_invoke: the module of invokable factory \"%s\" has been unloaded.\n", invokable_factory->name.c_str());
+            }
+            factory = successor;
+            factory->acquire();
+        }
+        if (factory->voice_bank != nullptr) {
+            if (RATE != 0) {
+                release_factory(csound);
+                return csound->InitError(csound, "%s: voice bank \"%s\" must be invoked by cxx_invoke.\n", opds.optext->t.opcod, invokable_factory->name.c_str());
+            }
+            if (thread_() == 1) {
+                release_factory(csound);
+                return csound->InitError(csound, "cxx_invoke: voice bank \"%s\" must run at k-rate.\n", invokable_factory->name.c_str());
+            }
+            if (thread_() == 4) {
+                release_factory(csound);
+                return csound->InitError(csound, "cxx_invoke: voice bank \"%s\" cannot run on the offload worker.\n", invokable_factory->name.c_str());
+            }
+            voice = profiled(CxxProfile::INIT, [&]() {
+                return factory->voice_bank->add_voice(csound, &opds, outputs, inputs);
+            });
+            if (context->diagnostics_enabled) csound->Message(csound, "####### cxx_invoke::init: added voice:             %d\n", voice);
+            if (voice < 0) {
+                release_factory(csound);
+                return csound->InitError(csound, "cxx_invoke: voice bank \"%s\" has no free voice.\n", invokable_factory->name.c_str());
+            }
+            zero_outputs_(csound);
+            return result;
+        }
+        cxx_invokable = factory->instantiate();
+        if (context->diagnostics_enabled) csound->Message(csound, "####### cxx_invoke::init: created new invokable:   %p for thread: %d\n", cxx_invokable, thread);
+         if (thread_() == 2) {
+            return result;
+        }
+        if (thread_() == 4) {
+            return offload_(csound);
         }
+        // Invoke the instance.
+        result = profiled(CxxProfile::INIT, [&]() {
+            return cxx_invokable->init(csound, &opds, outputs, inputs);
+        });
+        if (context->diagnostics_enabled) csound->Message(csound, "####### cxx_invoke::init: result of invokation:    %d\n", result);
         return result;
     }
+    /**
+     * Invokes the `init` method of the instance with the copy of the opcode 
+     * in its offload job, then hands the job over to the offload worker, 
+     * which from now on calls its `kontrol` method with copies of the inputs 
+     * and outputs. Offloaded instances do not migrate to reloaded modules.
+     */
+    int offload_(CSOUND *csound)
+    {
+        auto ksmps = opds.insdshead->ksmps;
+        std::vector<uint32_t> input_sizes;
+        std::vector<MYFLT *> passed_inputs;
+        for (unsigned int i = 0; i + 2 < opds.optext->t.inArgCount; ++i) {
+            auto type = csound->GetTypeForArg(inputs[i]);
+            auto type_name = type == nullptr ? "" : type->varTypeName;
+            if (std::strcmp(type_name, "a") == 0) {
+                input_sizes.push_back(ksmps);
+            } else if (std::strcmp(type_name, "k") == 0 || std::strcmp(type_name, "i") == 0 || std::strcmp(type_name, "c") == 0) {
+                input_sizes.push_back(1);
+            } else {
+                input_sizes.push_back(0);
+            }
+            passed_inputs.push_back(inputs[i]);
+        }
+        std::vector<uint32_t> output_sizes;
+        for (unsigned int i = 0; i < opds.optext->t.outArgCount; ++i) {
+            auto type = csound->GetTypeForArg(outputs[i]);
+            auto type_name = type == nullptr ? "" : type->varTypeName;
+            if (std::strcmp(type_name, "a") == 0) {
+                output_sizes.push_back(ksmps);
+            } else if (std::strcmp(type_name, "k") == 0 || std::strcmp(type_name, "i") == 0) {
+                output_sizes.push_back(1);
+            } else {
+                return csound->InitError(csound, "cxx_invoke: output %d of offloaded invokable \"%s\" is neither a-rate nor k-rate.\n", i + 1, factory->name.c_str());
+            }
+        }
+        auto latency = cxx_offload_latency();
+        std::unique_ptr<CxxOffloadJob> job(new CxxOffloadJob(csound, opds, factory, cxx_invokable, latency, input_sizes, passed_inputs, output_sizes));
+        auto result = profiled(CxxProfile::INIT, [&]() {
+            return cxx_invokable->init(csound, &job->opds, outputs, inputs);
+        });
+        if (context->diagnostics_enabled) csound->Message(csound, "####### cxx_invoke::init: result of invokation:    %d\n", result);
+        if (result != OK) {
+            // The instance refers to the job, so it is turned off now.
+            cxx_invokable->noteoff(csound);
+            factory->release(cxx_invokable);
+            cxx_invokable = nullptr;
+            release_factory(csound);
+            return result;
+        }
+        auto worker = context->offload_worker.load(std::memory_order_acquire);
+        if (worker == nullptr) {
+            std::lock_guard<std::mutex> lock(context->mutex);
+            worker = context->offload_worker.load(std::memory_order_relaxed);
+            if (worker == nullptr) {
+                worker = new CxxOffloadWorker(*context);
+                context->offload_worker.store(worker, std::memory_order_release);
+                csound->Message(csound, "cxx_invoke: offloaded invokables run on a worker thread with a latency of %d kperiods.\n", (int) latency);
+            }
+        }
+        offload = worker->submit(std::move(job));
+        migration_declined = true;
+        return OK;
+    }
+    /**
+     * The typed variants only call the instance, since they neither wait 
+     * for pending modules, nor offload or migrate their instances, nor use 
+     * voice banks.
+     */
     int kontrol(CSOUND *csound)
     {
+        if (RATE != 0) {
+            return profiled(CxxProfile::KONTROL, [&]() {
+                return cxx_invokable->kontrol(csound, outputs, inputs);
+            });
+        }
         int result = OK;
-        if (thread == 1) {
+        if (pending == true) {
+            // Look for the factory again only when a new module has been 
+            // started.
+            CxxFactoryRegistry::Reader reader(context->factory_registry);
+            auto generation = context->modules_generation.load();
+            auto invokable_factory = generation == pending_generation ? nullptr : cxx_resolve_factory(*context, csound, S_invokable_factory->data);
+            pending_generation = generation;
+            if (invokable_factory == nullptr) {
+                if (context->compile_queue.unstarted() == 0) {
+                    return csound->PerfError(csound, &opds, "cxx_invoke: invokable factory \"%s\" not found.\n", S_invokable_factory->data);
+                }
+                zero_outputs_(csound);
+                return result;
+            }
+            pending = false;
+            result = create(csound, invokable_factory);
+            if (result != OK) {
+                return result;
+            }
+        }
+        if (offload != nullptr) {
+            result = offload->exchange(outputs, inputs, *opds.insdshead);
+            context->offload_worker.load(std::memory_order_relaxed)->wake();
+            if (result != OK) {
+                return csound->PerfError(csound, &opds, "cxx_invoke: offloaded invokable \"%s\" failed with result %d.\n", S_invokable_factory->data, result);
+            }
             return result;
         }
-        result = cxx_invokable->kontrol(csound, outputs, inputs);
+        if (voice >= 0) {
+            return profiled(CxxProfile::KONTROL, [&]() {
+                return factory->voice_bank->process(csound);
+            });
+        }
+        if (thread_() == 1) {
+            return result;
+        }
+        if (migration_declined == false) {
+            auto successor = factory->successor.load(std::memory_order_acquire);
+            if (successor != nullptr) {
+                migrate(csound, successor);
+            }
+        }
+        result = profiled(CxxProfile::KONTROL, [&]() {
+            return cxx_invokable->kontrol(csound, outputs, inputs);
+        });
         return result;
 
     }
+    /**
+     * Offers the state of the running instance to a new instance from the 
+     * factory that `cxx_reload` put in place of this note's factory. If the 
+     * new instance takes over, the note continues with it, and the running 
+     * instance is turned off; otherwise the new instance is discarded. 
+     * Nothing is instantiated unless the new module declares, with 
+     * `CXX_INVOKABLE_MIGRATES`, that the factory migrates running notes. 
+     * Notes with only an i-time pass have no state to migrate.
+     */
+    void migrate(CSOUND *csound, const CxxFactory *successor)
+    {
+        if (successor->migrates == false || (successor->create == nullptr && successor->pool == nullptr)) {
+            migration_declined = true;
+            return;
+        }
+        successor->acquire();
+        auto new_invokable = successor->instantiate();
+        int result = OK;
+        if (thread_() != 2) {
+            result = new_invokable->init(csound, &opds, outputs, inputs);
+        }
+        if (result == OK && new_invokable->migrate(cxx_invokable) == true) {
+            if (context->diagnostics_enabled) csound->Message(csound, "####### cxx_invoke::kontrol: migrated %p to %p.\n", cxx_invokable, new_invokable);
+            cxx_invokable->noteoff(csound);
+            factory->release(cxx_invokable);
+            release_factory(csound);
+            factory = successor;
+            cxx_invokable = new_invokable;
+            return;
+        }
+        new_invokable->noteoff(csound);
+        successor->release(new_invokable);
+        if (successor->unacquire()) {
+            context->module_collector.request();
+        }
+        migration_declined = true;
+    }
+    /**
+     * Gives up this note's reference to its factory, and has the module of 
+     * the factory unloaded if it has been replaced and this was its last 
+     * note.
+     */
+    void release_factory(CSOUND *csound)
+    {
+        if (factory->unacquire()) {
+            context->module_collector.request();
+        }
+        factory = nullptr;
+    }
+    /**
+     * Calls into the factory's instance or voice bank, timing the call if 
+     * profiling is enabled.
+     */
+    template<typename Call>
+    int profiled(int phase, Call call)
+    {
+        if (cxx_profile_enabled() == false) {
+            return call();
+        }
+        auto start = cxx_nanoseconds();
+        int result = call();
+        factory->profile->record(phase, cxx_nanoseconds() - start);
+        return result;
+    }
     int noteoff(CSOUND *csound) {
-        if (cxx_diagnostics_enabled()) csound->Message(csound, "####### cxx_invoke::noteoff\n");
+        if (context->diagnostics_enabled) csound->Message(csound, "####### cxx_invoke::noteoff\n");
         int result = OK;
-        result = cxx_invokable->noteoff(csound);
-        if (cxx_diagnostics_enabled()) csound->Message(csound, "####### cxx_invoke::noteoff: invokable::noteoff: result: %d\n", result);
+        if (offload != nullptr) {
+            // The worker turns the instance off, returns it to the factory, 
+            // and gives up the job's reference to the factory.
+            auto late_kperiods = offload->late_kperiods.load();
+            if (late_kperiods > 0) {
+                csound->Message(csound, "WARNING: cxx_invoke: offloaded invokable \"%s\" was late for %llu kperiods, which were silent.\n", S_invokable_factory->data, (unsigned long long) late_kperiods);
+            }
+            offload->release();
+            offload = nullptr;
+            cxx_invokable = nullptr;
+            factory = nullptr;
+            context->offload_worker.load(std::memory_order_relaxed)->wake();
+            return result;
+        }
+        if (voice >= 0) {
+            profiled(CxxProfile::NOTEOFF, [&]() {
+                factory->voice_bank->remove_voice(csound, voice);
+                return OK;
+            });
+            voice = -1;
+        }
         if (cxx_invokable != nullptr) {
-            delete cxx_invokable;
+            result = profiled(CxxProfile::NOTEOFF, [&]() {
+                return cxx_invokable->noteoff(csound);
+            });
+            if (context->diagnostics_enabled) csound->Message(csound, "####### cxx_invoke::noteoff: invokable::noteoff: result: %d\n", result);
+            factory->release(cxx_invokable);
             cxx_invokable = nullptr;
         }
+        if (factory != nullptr) {
+            release_factory(csound);
+        }
         return result;
     }
 };
 
+/**
+ * `cxx_invoke` takes the thread as its second argument, and may run at 
+ * i-time only or at i-time and k-time.
+ */
+typedef CxxInvokeOpcode<0> CxxInvoke;
+
+/**
+ * `cxx_invoke_a` and `cxx_invoke_k` always run at i-time and k-time, and 
+ * have only a-rate or only k-rate outputs. Their rates are fixed by their 
+ * type strings, so that Csound checks their arguments at compile time, 
+ * and the thread checks and output type lookups are compiled away.
+ */
+typedef CxxInvokeOpcode<3, 'a'> CxxInvokeA;
+typedef CxxInvokeOpcode<3, 'k'> CxxInvokeK;
+
 std::vector<std::string> get_operating_system() {
     std::string operating_system = "Unidentified operating system.";
     std::string macros;
@@ -482,6 +4197,15 @@ extern "C" {
 
     PUBLIC int csoundModuleInit_cxx_opcodes(CSOUND *csound)
     {
+        if (csound->CreateGlobalVariable(csound, "cxx_opcodes_context", sizeof(CxxContext *)) == CSOUND_SUCCESS) {
+            *(CxxContext **) csound->QueryGlobalVariableNoCheck(csound, "cxx_opcodes_context") = new CxxContext(csound);
+            // Counts the opcodes registered by `cxx_append_opcode`.
+            csound->CreateGlobalVariable(csound, "cxx_opcodes_native_opcodes", sizeof(int));
+            // Finds the named buses of `cxx_bus`.
+            csound->CreateGlobalVariable(csound, "cxx_opcodes_buses", sizeof(CxxBusRegistry));
+            ((CxxBusRegistry *) csound->QueryGlobalVariableNoCheck(csound, "cxx_opcodes_buses"))->acquire = cxx_bus_acquire;
+            cxx_csound_instances()++;
+        }
         int status = csound->AppendOpcode(csound,
                                           (char *)"cxx_compile",
                                           sizeof(CxxCompile),
@@ -502,6 +4226,106 @@ extern "C" {
                                           (int (*)(CSOUND*,void*)) CxxInvoke::init_,
                                           (int (*)(CSOUND*,void*)) CxxInvoke::kontrol_,
                                           (int (*)(CSOUND*,void*)) 0);
+        status += csound->AppendOpcode(csound,
+                                          (char *)"cxx_invoke_a",
+                                          sizeof(CxxInvokeA),
+                                          0,
+                                          3,
+                                          (char *)"mmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmmm",
+                                          (char *)"SM",
+                                          (int (*)(CSOUND*,void*)) CxxInvokeA::init_,
+                                          (int (*)(CSOUND*,void*)) CxxInvokeA::kontrol_,
+                                          (int (*)(CSOUND*,void*)) 0);
+        status += csound->AppendOpcode(csound,
+                                          (char *)"cxx_invoke_k",
+                                          sizeof(CxxInvokeK),
+                                          0,
+                                          3,
+                                          (char *)"zzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzzz",
+                                          (char *)"SM",
+                                          (int (*)(CSOUND*,void*)) CxxInvokeK::init_,
+                                          (int (*)(CSOUND*,void*)) CxxInvokeK::kontrol_,
+                                          (int (*)(CSOUND*,void*)) 0);
+        status += csound->AppendOpcode(csound,
+                                          (char *)"cxx_compile_async",
+                                          sizeof(CxxCompileAsync),
+                                          0,
+                                          1,
+                                          (char *)"i",
+                                          (char *)"SSW",
+                                          (int (*)(CSOUND*,void*)) CxxCompileAsync::init_,
+                                          (int (*)(CSOUND*,void*)) 0,
+                                          (int (*)(CSOUND*,void*)) 0);
+        status += csound->AppendOpcode(csound,
+                                          (char *)"cxx_reload",
+                                          sizeof(CxxReload),
+                                          0,
+                                          1,
+                                          (char *)"i",
+                                          (char *)"SSW",
+                                          (int (*)(CSOUND*,void*)) CxxReload::init_,
+                                          (int (*)(CSOUND*,void*)) 0,
+                                          (int (*)(CSOUND*,void*)) 0);
+        status += csound->AppendOpcode(csound,
+                                          (char *)"cxx_unload",
+                                          sizeof(CxxUnload),
+                                          0,
+                                          1,
+                                          (char *)"i",
+                                          (char *)"S",
+                                          (int (*)(CSOUND*,void*)) CxxUnload::init_,
+                                          (int (*)(CSOUND*,void*)) 0,
+                                          (int (*)(CSOUND*,void*)) 0);
+        status += csound->AppendOpcode(csound,
+                                          (char *)"cxx_compile_status",
+                                          sizeof(CxxCompileStatus),
+                                          0,
+                                          3,
+                                          (char *)"k",
+                                          (char *)"i",
+                                          (int (*)(CSOUND*,void*)) CxxCompileStatus::init_,
+                                          (int (*)(CSOUND*,void*)) CxxCompileStatus::kontrol_,
+                                          (int (*)(CSOUND*,void*)) 0);
+        status += csound->AppendOpcode(csound,
+                                          (char *)"cxx_compile_wait",
+                                          sizeof(CxxCompileWait),
+                                          0,
+                                          1,
+                                          (char *)"i",
+                                          (char *)"",
+                                          (int (*)(CSOUND*,void*)) CxxCompileWait::init_,
+                                          (int (*)(CSOUND*,void*)) 0,
+                                          (int (*)(CSOUND*,void*)) 0);
+        status += csound->AppendOpcode(csound,
+                                          (char *)"cxx_prewarm",
+                                          sizeof(CxxPrewarm),
+                                          0,
+                                          1,
+                                          (char *)"i",
+                                          (char *)"S",
+                                          (int (*)(CSOUND*,void*)) CxxPrewarm::init_,
+                                          (int (*)(CSOUND*,void*)) 0,
+                                          (int (*)(CSOUND*,void*)) 0);
+        status += csound->AppendOpcode(csound,
+                                          (char *)"cxx_cache_clear",
+                                          sizeof(CxxCacheClear),
+                                          0,
+                                          1,
+                                          (char *)"i",
+                                          (char *)"",
+                                          (int (*)(CSOUND*,void*)) CxxCacheClear::init_,
+                                          (int (*)(CSOUND*,void*)) 0,
+                                          (int (*)(CSOUND*,void*)) 0);
+        status += csound->AppendOpcode(csound,
+                                          (char *)"cxx_profile",
+                                          sizeof(CxxProfileReport),
+                                          0,
+                                          1,
+                                          (char *)"i",
+                                          (char *)"W",
+                                          (int (*)(CSOUND*,void*)) CxxProfileReport::init_,
+                                          (int (*)(CSOUND*,void*)) 0,
+                                          (int (*)(CSOUND*,void*)) 0);
         status += csound->AppendOpcode(csound,
                                           (char *)"cxx_os",
                                           sizeof(CxxOperatingSystem),
@@ -527,7 +4351,34 @@ extern "C" {
 
     PUBLIC int csoundModuleDestroy_cxx_opcodes(CSOUND *csound)
     {
-        loaded_modules().clear();
+        auto context = cxx_context(csound);
+        if (context == nullptr) {
+            return 0;
+        }
+        if (cxx_profile_enabled()) {
+            csound->Message(csound, "%s", cxx_profile_report(csound, context->factory_registry, false).c_str());
+            auto profile_filepath = cxx_profile_filepath();
+            if (profile_filepath.empty() == false && cxx_profile_write(csound, context->factory_registry, profile_filepath) == false) {
+                csound->Message(csound, "WARNING: cxx_profile: could not write \"%s\".\n", profile_filepath.c_str());
+            }
+        }
+        // The modules started by this Csound instance are unloaded, and its 
+        // context is deleted. What is shared by all Csound instances in the 
+        // process is released only with the last of them.
+        delete context->offload_worker.exchange(nullptr);
+        context->module_collector.stop();
+        cxx_unload_modules(*context, nullptr);
+        for (auto module_handle : context->opcode_modules) {
+            cxx_release_module(module_handle);
+        }
+        delete context;
+        csound->DestroyGlobalVariable(csound, "cxx_opcodes_context");
+        csound->DestroyGlobalVariable(csound, "cxx_opcodes_native_opcodes");
+        csound->DestroyGlobalVariable(csound, "cxx_opcodes_buses");
+        if (--cxx_csound_instances() > 0) {
+            return 0;
+        }
+        cxx_remove_temporary_files();
         return 0;
     }
 